@@ -0,0 +1,174 @@
+#!/usr/bin/env python
+"""
+End-to-end WsgiBoostServer load benchmark
+
+Starts WsgiBoostHttp/WsgiBoostHttps in-process for each scenario,
+drives it with the C++ load generator from ``loadgen`` folder
+and saves the results as JSON.
+
+``--compare BASE.json NEW.json`` prints the difference between two result files,
+e.g. for builds with epoll and io_uring I/O backends.
+"""
+
+import argparse
+import json
+import os
+import shutil
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+import wsgi_boost
+
+this_dir = os.path.dirname(os.path.abspath(__file__))
+cert_dir = os.path.join(os.path.dirname(this_dir), 'test_wsgi_boost')
+
+json_data = json.dumps({
+    'id': 78874,
+    'seriesName': 'Firefly',
+    'aliases': ['Serenity'],
+    'status': 'Ended',
+    'firstAired': '2002-09-20',
+    'network': 'FOX (US)',
+    'genre': ['Drama', 'Science-Fiction'],
+    'overview': 'In the far-distant future, Captain Malcolm "Mal" Reynolds is a renegade former brown-coat sergeant, '
+                'now turned smuggler & rogue, who is the commander of a small spacecraft.',
+    'siteRating': 9.5,
+    'siteRatingCount': 472,
+}).encode('utf-8')
+
+
+def app(environ, start_response):
+    path = environ['PATH_INFO']
+    if path == '/json':
+        body = json_data
+        content_type = 'application/json'
+    elif path == '/upload':
+        length = int(environ.get('CONTENT_LENGTH') or 0)
+        body = str(len(environ['wsgi.input'].read(length))).encode('utf-8')
+        content_type = 'text/plain'
+    else:
+        body = b'Hello World!'
+        content_type = 'text/plain'
+    start_response('200 OK', [('Content-Type', content_type), ('Content-Length', str(len(body)))])
+    return [body]
+
+
+# name: (HTTPS, method, path, request body size)
+SCENARIOS = {
+    'hello-world': (False, 'GET', '/', 0),
+    'json': (False, 'GET', '/json', 0),
+    'static-small': (False, 'GET', '/static/small.bin', 0),
+    'static-large': (False, 'GET', '/static/large.bin', 0),
+    'upload': (False, 'POST', '/upload', 65536),
+    'https': (True, 'GET', '/', 0),
+}
+
+
+def create_server(https, port, threads, static_dir):
+    if https:
+        httpd = wsgi_boost.WsgiBoostHttps(os.path.join(cert_dir, 'server.crt'),
+                                          os.path.join(cert_dir, 'server.key'),
+                                          port=port, threads=threads)
+    else:
+        httpd = wsgi_boost.WsgiBoostHttp(port=port, threads=threads)
+    httpd.add_static_route('^/static', static_dir)
+    httpd.set_app(app)
+    return httpd
+
+
+def run_scenario(name, args, static_dir):
+    https, method, path, body_size = SCENARIOS[name]
+    httpd = create_server(https, args.port, args.threads, static_dir)
+    server_thread = threading.Thread(target=httpd.start)
+    server_thread.daemon = True
+    server_thread.start()
+    time.sleep(0.5)
+    try:
+        output = subprocess.check_output([
+            args.loadgen,
+            '--port', str(args.port),
+            '--connections', str(args.connections),
+            '--threads', str(args.loadgen_threads),
+            '--duration', str(args.duration),
+            '--warmup', str(args.warmup),
+            '--pipeline', str(args.pipeline),
+            '--method', method,
+            '--path', path,
+            '--body-size', str(body_size),
+        ] + (['--tls'] if https else []))
+    finally:
+        httpd.stop()
+        server_thread.join()
+    return json.loads(output.decode('utf-8'))
+
+
+def compare(base_file, new_file):
+    with open(base_file) as fo:
+        base = json.load(fo)
+    with open(new_file) as fo:
+        new = json.load(fo)
+    print('I/O backend: {0} -> {1}'.format(base.get('io_backend', '?'), new.get('io_backend', '?')))
+    print('{0:<14} {1:>12} {2:>12} {3:>8} {4:>10} {5:>10} {6:>8}'.format(
+        'scenario', 'base rps', 'new rps', 'change', 'base p99', 'new p99', 'change'))
+    for name in sorted(set(base['scenarios']) & set(new['scenarios'])):
+        base_result = base['scenarios'][name]
+        new_result = new['scenarios'][name]
+        base_rps = base_result['requests_per_second']
+        new_rps = new_result['requests_per_second']
+        base_p99 = base_result['latency_us']['p99']
+        new_p99 = new_result['latency_us']['p99']
+        print('{0:<14} {1:>12.1f} {2:>12.1f} {3:>+7.1f}% {4:>10} {5:>10} {6:>+7.1f}%'.format(
+            name, base_rps, new_rps, (new_rps / base_rps - 1) * 100 if base_rps else 0.0,
+            base_p99, new_p99, (float(new_p99) / base_p99 - 1) * 100 if base_p99 else 0.0))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--loadgen', default=os.path.join(this_dir, 'build-loadgen', 'loadgen'),
+                        help='path to the load generator executable')
+    parser.add_argument('--scenarios', default=','.join(sorted(SCENARIOS)),
+                        help='comma-separated scenarios: ' + ', '.join(sorted(SCENARIOS)))
+    parser.add_argument('--threads', type=int, default=1, help='server threads')
+    parser.add_argument('--connections', type=int, default=64)
+    parser.add_argument('--loadgen-threads', type=int, default=1)
+    parser.add_argument('--pipeline', type=int, default=1, help='pipelined requests per connection')
+    parser.add_argument('--duration', type=float, default=10.0, help='seconds')
+    parser.add_argument('--warmup', type=float, default=1.0, help='seconds')
+    parser.add_argument('--port', type=int, default=8000)
+    # The server prints its messages to stdout, so results are saved to a file
+    parser.add_argument('--output', default='load_bench.json', help='JSON output file')
+    parser.add_argument('--compare', nargs=2, metavar=('BASE', 'NEW'),
+                        help='compare two JSON result files instead of running the benchmark')
+    args = parser.parse_args()
+    if args.compare:
+        compare(*args.compare)
+        return
+
+    static_dir = tempfile.mkdtemp()
+    try:
+        with open(os.path.join(static_dir, 'small.bin'), 'wb') as fo:
+            fo.write(os.urandom(1024))
+        with open(os.path.join(static_dir, 'large.bin'), 'wb') as fo:
+            fo.write(os.urandom(1048576))
+        results = {
+            'version': wsgi_boost.__version__,
+            'io_backend': getattr(wsgi_boost, 'io_backend', 'unknown'),
+            'server_threads': args.threads,
+            'scenarios': {},
+        }
+        for name in args.scenarios.split(','):
+            if SCENARIOS[name][0] and not hasattr(wsgi_boost, 'WsgiBoostHttps'):
+                continue
+            results['scenarios'][name] = run_scenario(name, args, static_dir)
+    finally:
+        shutil.rmtree(static_dir)
+    with open(args.output, 'w') as fo:
+        json.dump(results, fo, indent=2, sort_keys=True)
+        fo.write('\n')
+
+
+if __name__ == '__main__':
+    sys.exit(main())
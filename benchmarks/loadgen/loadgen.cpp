@@ -0,0 +1,309 @@
+/*
+HTTP load generator for WsgiBoostServer benchmarks
+
+Opens many keep-alive connections, optionally pipelines requests
+and prints throughput and latency percentiles as JSON.
+
+Copyright (c) 2017 Roman Miroshnychenko <romanvm@yandex.ua>
+License: MIT, see License.txt
+*/
+
+#include <boost/asio.hpp>
+#include <boost/asio/spawn.hpp>
+#include <boost/asio/ssl.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+using boost::asio::ip::tcp;
+typedef std::chrono::steady_clock clock_type;
+
+namespace
+{
+	struct Options
+	{
+		std::string host = "127.0.0.1";
+		unsigned short port = 8000;
+		unsigned int connections = 64;
+		unsigned int threads = 1;
+		double duration = 10.0;
+		double warmup = 1.0;
+		unsigned int pipeline = 1;
+		std::string method = "GET";
+		std::string path = "/";
+		size_t body_size = 0;
+		bool tls = false;
+	};
+
+	// Per-thread results
+	struct Stats
+	{
+		std::vector<uint32_t> latencies; // microseconds
+		uint64_t requests = 0;
+		uint64_t errors = 0;
+		uint64_t bytes = 0;
+	};
+
+	void usage()
+	{
+		std::cerr << "Usage: loadgen [--host 127.0.0.1] [--port 8000] [--connections 64] [--threads 1]\n"
+			"               [--duration 10] [--warmup 1] [--pipeline 1] [--method GET] [--path /]\n"
+			"               [--body-size 0] [--tls]\n";
+		std::exit(2);
+	}
+
+	Options parse_args(int argc, char** argv)
+	{
+		Options options;
+		for (int i = 1; i < argc; ++i)
+		{
+			std::string arg = argv[i];
+			if (arg == "--tls")
+			{
+				options.tls = true;
+				continue;
+			}
+			if (i + 1 == argc)
+				usage();
+			std::string value = argv[++i];
+			if (arg == "--host")
+				options.host = value;
+			else if (arg == "--port")
+				options.port = static_cast<unsigned short>(std::stoul(value));
+			else if (arg == "--connections")
+				options.connections = std::stoul(value);
+			else if (arg == "--threads")
+				options.threads = std::stoul(value);
+			else if (arg == "--duration")
+				options.duration = std::stod(value);
+			else if (arg == "--warmup")
+				options.warmup = std::stod(value);
+			else if (arg == "--pipeline")
+				options.pipeline = std::max(1UL, std::stoul(value));
+			else if (arg == "--method")
+				options.method = value;
+			else if (arg == "--path")
+				options.path = value;
+			else if (arg == "--body-size")
+				options.body_size = std::stoul(value);
+			else
+				usage();
+		}
+		if (options.connections == 0 || options.threads == 0)
+			usage();
+		return options;
+	}
+
+	std::string build_request(const Options& options)
+	{
+		std::string request = options.method + " " + options.path + " HTTP/1.1\r\n"
+			"Host: " + options.host + ":" + std::to_string(options.port) + "\r\n"
+			"Accept: */*\r\n";
+		if (options.body_size > 0 || options.method == "POST" || options.method == "PUT")
+		{
+			request += "Content-Type: application/octet-stream\r\n"
+				"Content-Length: " + std::to_string(options.body_size) + "\r\n";
+		}
+		request += "\r\n" + std::string(options.body_size, 'x');
+		std::string batch;
+		for (unsigned int i = 0; i < options.pipeline; ++i)
+			batch += request;
+		return batch;
+	}
+
+	// Read exactly length bytes of a response body
+	template <class Stream>
+	bool read_body(Stream& stream, boost::asio::streambuf& buffer, size_t length, boost::asio::yield_context yc)
+	{
+		boost::system::error_code ec;
+		if (buffer.size() < length)
+			boost::asio::async_read(stream, buffer, boost::asio::transfer_exactly(length - buffer.size()), yc[ec]);
+		if (ec)
+			return false;
+		buffer.consume(length);
+		return true;
+	}
+
+	// Read a response, returns false on a connection error or a non-2xx/3xx status
+	template <class Stream>
+	bool read_response(Stream& stream, boost::asio::streambuf& buffer, size_t& bytes, boost::asio::yield_context yc)
+	{
+		boost::system::error_code ec;
+		size_t header_length = boost::asio::async_read_until(stream, buffer, "\r\n\r\n", yc[ec]);
+		if (ec)
+			return false;
+		auto begin = boost::asio::buffers_begin(buffer.data());
+		std::string header{ begin, begin + header_length };
+		buffer.consume(header_length);
+		bytes = header_length;
+		if (header.length() < 12 || header.compare(0, 5, "HTTP/") != 0 || (header[9] != '2' && header[9] != '3'))
+			return false;
+		std::transform(header.begin(), header.end(), header.begin(), ::tolower);
+		long long content_length = 0;
+		size_t pos = header.find("\r\ncontent-length:");
+		if (pos != std::string::npos)
+			content_length = std::atoll(header.c_str() + pos + 17);
+		pos = header.find("\r\ntransfer-encoding:");
+		if (pos != std::string::npos && header.find("chunked", pos) < header.find("\r\n", pos + 2))
+		{
+			while (true)
+			{
+				size_t line_length = boost::asio::async_read_until(stream, buffer, "\r\n", yc[ec]);
+				if (ec)
+					return false;
+				begin = boost::asio::buffers_begin(buffer.data());
+				size_t chunk_size = std::stoul(std::string{ begin, begin + line_length }, nullptr, 16);
+				buffer.consume(line_length);
+				bytes += line_length + chunk_size + 2;
+				if (!read_body(stream, buffer, chunk_size + 2, yc))
+					return false;
+				if (chunk_size == 0)
+					return true; // Trailers are not supported
+			}
+		}
+		bytes += content_length;
+		return read_body(stream, buffer, static_cast<size_t>(content_length), yc);
+	}
+
+	template <class Stream>
+	bool connect(Stream& stream, const tcp::endpoint& endpoint, boost::asio::yield_context yc);
+
+	template <>
+	bool connect(tcp::socket& socket, const tcp::endpoint& endpoint, boost::asio::yield_context yc)
+	{
+		boost::system::error_code ec;
+		socket.async_connect(endpoint, yc[ec]);
+		if (!ec)
+			socket.set_option(tcp::no_delay(true), ec);
+		return !ec;
+	}
+
+	template <>
+	bool connect(boost::asio::ssl::stream<tcp::socket>& stream, const tcp::endpoint& endpoint, boost::asio::yield_context yc)
+	{
+		boost::system::error_code ec;
+		if (!connect(stream.next_layer(), endpoint, yc))
+			return false;
+		stream.async_handshake(boost::asio::ssl::stream_base::client, yc[ec]);
+		return !ec;
+	}
+
+	// Run requests on one connection until the deadline, reconnecting on errors
+	template <class Stream, class MakeStream>
+	void run_client(MakeStream make_stream, const tcp::endpoint& endpoint, const std::string& batch,
+		unsigned int pipeline, clock_type::time_point record_from, clock_type::time_point deadline,
+		Stats& stats, boost::asio::yield_context yc)
+	{
+		while (clock_type::now() < deadline)
+		{
+			std::unique_ptr<Stream> stream = make_stream();
+			if (!connect(*stream, endpoint, yc))
+			{
+				++stats.errors;
+				continue;
+			}
+			boost::asio::streambuf buffer;
+			bool ok = true;
+			while (ok && clock_type::now() < deadline)
+			{
+				boost::system::error_code ec;
+				auto start = clock_type::now();
+				boost::asio::async_write(*stream, boost::asio::buffer(batch), yc[ec]);
+				ok = !ec;
+				for (unsigned int i = 0; ok && i < pipeline; ++i)
+				{
+					size_t bytes = 0;
+					ok = read_response(*stream, buffer, bytes, yc);
+					auto end = clock_type::now();
+					if (ok && start >= record_from)
+					{
+						++stats.requests;
+						stats.bytes += bytes;
+						stats.latencies.push_back(static_cast<uint32_t>(
+							std::chrono::duration_cast<std::chrono::microseconds>(end - start).count()));
+					}
+				}
+				if (!ok && clock_type::now() < deadline)
+					++stats.errors;
+			}
+		}
+	}
+
+	uint32_t percentile(const std::vector<uint32_t>& sorted, double p)
+	{
+		if (sorted.empty())
+			return 0;
+		size_t index = static_cast<size_t>(std::ceil(p * sorted.size()));
+		return sorted[std::min(sorted.size(), std::max<size_t>(index, 1)) - 1];
+	}
+}
+
+
+int main(int argc, char** argv)
+{
+	Options options = parse_args(argc, argv);
+	tcp::endpoint endpoint{ boost::asio::ip::address::from_string(options.host), options.port };
+	std::string batch = build_request(options);
+	boost::asio::ssl::context ssl_context{ boost::asio::ssl::context::sslv23_client };
+	ssl_context.set_verify_mode(boost::asio::ssl::verify_none);
+
+	auto record_from = clock_type::now() + std::chrono::microseconds(static_cast<long long>(options.warmup * 1e6));
+	auto deadline = record_from + std::chrono::microseconds(static_cast<long long>(options.duration * 1e6));
+	std::vector<Stats> stats(options.threads);
+	std::vector<std::thread> threads;
+	for (unsigned int t = 0; t < options.threads; ++t)
+	{
+		threads.emplace_back([&, t]()
+		{
+			boost::asio::io_service io_service;
+			for (unsigned int c = t; c < options.connections; c += options.threads)
+			{
+				boost::asio::spawn(io_service, [&](boost::asio::yield_context yc)
+				{
+					if (options.tls)
+					{
+						typedef boost::asio::ssl::stream<tcp::socket> ssl_stream;
+						run_client<ssl_stream>([&]() { return std::unique_ptr<ssl_stream>(new ssl_stream(io_service, ssl_context)); },
+							endpoint, batch, options.pipeline, record_from, deadline, stats[t], yc);
+					}
+					else
+					{
+						run_client<tcp::socket>([&]() { return std::unique_ptr<tcp::socket>(new tcp::socket(io_service)); },
+							endpoint, batch, options.pipeline, record_from, deadline, stats[t], yc);
+					}
+				});
+			}
+			io_service.run();
+		});
+	}
+	for (auto& thread : threads)
+		thread.join();
+
+	Stats total;
+	for (auto& s : stats)
+	{
+		total.requests += s.requests;
+		total.errors += s.errors;
+		total.bytes += s.bytes;
+		total.latencies.insert(total.latencies.end(), s.latencies.begin(), s.latencies.end());
+	}
+	std::sort(total.latencies.begin(), total.latencies.end());
+	std::printf("{\"connections\": %u, \"threads\": %u, \"pipeline\": %u, \"duration\": %.3f, "
+		"\"requests\": %llu, \"errors\": %llu, \"bytes\": %llu, \"requests_per_second\": %.1f, "
+		"\"latency_us\": {\"p50\": %u, \"p90\": %u, \"p99\": %u, \"p999\": %u, \"max\": %u}}\n",
+		options.connections, options.threads, options.pipeline, options.duration,
+		static_cast<unsigned long long>(total.requests), static_cast<unsigned long long>(total.errors),
+		static_cast<unsigned long long>(total.bytes), total.requests / options.duration,
+		percentile(total.latencies, 0.5), percentile(total.latencies, 0.9), percentile(total.latencies, 0.99),
+		percentile(total.latencies, 0.999), total.latencies.empty() ? 0 : total.latencies.back());
+	return 0;
+}
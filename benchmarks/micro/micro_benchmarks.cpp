@@ -0,0 +1,264 @@
+/*
+Microbenchmarks for WsgiBoostServer C++ hot paths
+
+Connection-based benchmarks run inside a coroutine over a loopback TCP connection,
+so they include the same Asio read/write calls as the server.
+
+Copyright (c) 2017 Roman Miroshnychenko <romanvm@yandex.ua>
+License: MIT, see License.txt
+*/
+
+#include "request_handlers.h"
+
+#include <benchmark/benchmark.h>
+#include <boost/asio.hpp>
+#include <boost/asio/spawn.hpp>
+#include <boost/filesystem.hpp>
+
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+
+using namespace wsgi_boost;
+using boost::asio::ip::tcp;
+
+typedef std::shared_ptr<tcp::socket> socket_ptr;
+typedef Connection<socket_ptr> connection_t;
+typedef Request<connection_t> request_t;
+typedef Response<connection_t> response_t;
+
+namespace
+{
+	const std::string request_header =
+		"GET /api/items?page=2&per_page=50 HTTP/1.1\r\n"
+		"Host: 127.0.0.1:8000\r\n"
+		"User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:52.0) Gecko/20100101 Firefox/52.0\r\n"
+		"Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+		"Accept-Language: en-US,en;q=0.5\r\n"
+		"Accept-Encoding: gzip, deflate\r\n"
+		"Cookie: session=0123456789abcdef; theme=dark\r\n"
+		"Connection: keep-alive\r\n\r\n";
+
+	// Run a benchmark function in a coroutine with a connected loopback socket pair
+	template <class Func>
+	void run_on_loopback(benchmark::State& state, Func func)
+	{
+		boost::asio::io_service io_service;
+		tcp::acceptor acceptor{ io_service, tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0) };
+		socket_ptr server = std::make_shared<tcp::socket>(io_service);
+		tcp::socket client{ io_service };
+		client.connect(acceptor.local_endpoint());
+		acceptor.accept(*server);
+		server->set_option(tcp::no_delay(true));
+		boost::asio::spawn(io_service, [&](boost::asio::yield_context yc)
+		{
+			connection_t connection{ server, yc, 5, 300 };
+			func(state, connection, client);
+		});
+		io_service.run();
+	}
+
+	// Read all data available on a client socket
+	size_t drain(tcp::socket& client)
+	{
+		static std::vector<char> buffer(262144);
+		size_t total = 0;
+		while (client.available() > 0)
+			total += client.read_some(boost::asio::buffer(buffer));
+		return total;
+	}
+}
+
+
+static void BM_ParseHeader(benchmark::State& state)
+{
+	run_on_loopback(state, [](benchmark::State& state, connection_t& connection, tcp::socket& client)
+	{
+		// Requests are sent in pipelined batches to amortize the client write
+		const size_t batch_size = 64;
+		std::string batch;
+		for (size_t i = 0; i < batch_size; ++i)
+			batch += request_header;
+		size_t pending = 0;
+		while (state.KeepRunning())
+		{
+			if (pending == 0)
+			{
+				boost::asio::write(client, boost::asio::buffer(batch));
+				pending = batch_size;
+			}
+			request_t request{ connection };
+			benchmark::DoNotOptimize(request.parse_header());
+			--pending;
+		}
+		state.SetBytesProcessed(state.iterations() * request_header.length());
+	});
+}
+BENCHMARK(BM_ParseHeader);
+
+
+static void BM_SendHeader(benchmark::State& state)
+{
+	run_on_loopback(state, [](benchmark::State& state, connection_t& connection, tcp::socket& client)
+	{
+		ErrorPages error_pages;
+		size_t bytes = 0;
+		while (state.KeepRunning())
+		{
+			response_t response{ connection, error_pages };
+			response.keep_alive = true;
+			out_headers_t headers;
+			headers.emplace_back("Content-Type", "application/json");
+			headers.emplace_back("Content-Length", "973");
+			headers.emplace_back("Cache-Control", "no-cache");
+			benchmark::DoNotOptimize(response.send_header("200 OK", headers));
+			bytes += drain(client);
+		}
+		state.SetBytesProcessed(bytes);
+	});
+}
+BENCHMARK(BM_SendHeader);
+
+
+// Arguments: 1 - pre-rendered error page, 0 - html page rendered per response
+static void BM_SendError(benchmark::State& state)
+{
+	run_on_loopback(state, [](benchmark::State& state, connection_t& connection, tcp::socket& client)
+	{
+		ErrorPages error_pages;
+		size_t bytes = 0;
+		while (state.KeepRunning())
+		{
+			response_t response{ connection, error_pages };
+			response.keep_alive = true;
+			if (state.range(0))
+				benchmark::DoNotOptimize(response.send_error(404));
+			else
+				benchmark::DoNotOptimize(response.send_html("404 Not Found", "Error 404", "Not Found",
+					"The requested path was not found on this server."));
+			bytes += drain(client);
+		}
+		state.SetBytesProcessed(bytes);
+	});
+}
+BENCHMARK(BM_SendError)->Arg(1)->Arg(0);
+
+
+// Arguments: file size, 1 - sendfile(), 0 - in-memory file cache, file I/O threads
+static void BM_StaticFile(benchmark::State& state)
+{
+	boost::filesystem::path dir = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+	boost::filesystem::create_directories(dir);
+	{
+		std::ofstream ofs{ (dir / "file.bin").string(), std::ios::binary };
+		ofs << std::string(state.range(0), 'x');
+	}
+	run_on_loopback(state, [&dir](benchmark::State& state, connection_t& connection, tcp::socket& client)
+	{
+		std::string cache_control = "public, max-age=3600";
+		FileCache file_cache;
+		file_cache.configure(16777216, 16777216);
+		LookupCache lookup_cache;
+		BlockingPool blocking_pool; // Files are read in place without threads
+		blocking_pool.start(static_cast<unsigned int>(state.range(2)));
+		ErrorPages error_pages;
+		size_t bytes = 0;
+		while (state.KeepRunning())
+		{
+			request_t request{ connection };
+			request.method = "GET";
+			request.path = "/static/file.bin";
+			request.content_dir = dir.string();
+			request.content_path = "/file.bin";
+			response_t response{ connection, error_pages };
+			response.keep_alive = true;
+			StaticRequestHandler<request_t, response_t> handler{ request, response, cache_control, false, state.range(1) != 0, false, file_cache, lookup_cache, blocking_pool };
+			handler.handle();
+			bytes += drain(client);
+		}
+		state.SetBytesProcessed(bytes);
+	});
+	boost::filesystem::remove_all(dir);
+}
+BENCHMARK(BM_StaticFile)->Args({ 1024, 1, 0 })->Args({ 16384, 1, 0 })->Args({ 1024, 0, 0 })->Args({ 16384, 0, 0 })
+	->Args({ 1024, 1, 4 })->Args({ 1024, 0, 4 });
+
+
+// Arguments: 1 - check of a cached lookup result, 0 - full lookup
+static void BM_StaticLookup(benchmark::State& state)
+{
+	boost::filesystem::path dir = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+	boost::filesystem::create_directories(dir / "assets" / "css");
+	{
+		std::ofstream ofs{ (dir / "assets" / "css" / "style.css").string() };
+		ofs << "body {}";
+	}
+	const std::string content_dir = dir.string();
+	FileInfo info{};
+	lookup_file(content_dir, "/assets/css/style.css", info);
+	while (state.KeepRunning())
+	{
+		if (state.range(0))
+			benchmark::DoNotOptimize(check_file(info));
+		else
+			benchmark::DoNotOptimize(lookup_file(content_dir, "/assets/css/style.css", info));
+	}
+	boost::filesystem::remove_all(dir);
+}
+BENCHMARK(BM_StaticLookup)->Arg(1)->Arg(0);
+
+
+static void BM_TransformHeader(benchmark::State& state)
+{
+	while (state.KeepRunning())
+	{
+		std::string header = "Accept-Encoding";
+		transform_header(header);
+		benchmark::DoNotOptimize(header);
+	}
+}
+BENCHMARK(BM_TransformHeader);
+
+
+static void BM_Hex(benchmark::State& state)
+{
+	size_t value = 0x1f3a;
+	while (state.KeepRunning())
+		benchmark::DoNotOptimize(hex(value++));
+}
+BENCHMARK(BM_Hex);
+
+
+static void BM_ParseRange(benchmark::State& state)
+{
+	const std::string range = state.range(0) == 1 ? "bytes=1024-2047" : "bytes=0-99, 1000-1999, -500";
+	std::vector<ByteRange> ranges;
+	while (state.KeepRunning())
+	{
+		parse_range(range, 1048576, ranges);
+		benchmark::DoNotOptimize(ranges.data());
+	}
+}
+BENCHMARK(BM_ParseRange)->Arg(1)->Arg(3);
+
+
+static void BM_GetMime(benchmark::State& state)
+{
+	const std::string ext = ".PNG";
+	while (state.KeepRunning())
+		benchmark::DoNotOptimize(get_mime(ext));
+}
+BENCHMARK(BM_GetMime);
+
+
+static void BM_TimeToHeader(benchmark::State& state)
+{
+	time_t now = std::time(nullptr);
+	while (state.KeepRunning())
+		benchmark::DoNotOptimize(time_to_header(now));
+}
+BENCHMARK(BM_TimeToHeader);
+
+
+BENCHMARK_MAIN();
@@ -33,6 +33,12 @@ for item in sys.argv:
         ssl_enabled = False
         sys.argv.remove(item)
         break
+io_uring_enabled = False
+for item in sys.argv:
+    if '--with-io-uring' in item:
+        io_uring_enabled = True
+        sys.argv.remove(item)
+        break
 if ssl_enabled:
     for item in sys.argv:
         if '--open-ssl-dir' in item:
@@ -138,6 +144,10 @@ else:
     if ssl_enabled:
         define_macros.append(('HTTPS_ENABLED', None))
         libraries += ['crypto', 'ssl']
+    if io_uring_enabled:
+        # Boost.Asio uses io_uring for all I/O instead of epoll (Boost 1.78+, liburing)
+        define_macros += [('BOOST_ASIO_HAS_IO_URING', None), ('BOOST_ASIO_DISABLE_EPOLL', None)]
+        libraries.append('uring')
     extra_compile_args.append('-std=c++11')
 
 
@@ -7,6 +7,11 @@ Test suite for testing core WsgiBoostServer functionality
 from __future__ import print_function
 import os
 import sys
+import json
+import signal
+import tempfile
+import socket
+import ssl
 import threading
 import time
 import unittest
@@ -133,8 +138,8 @@ class WsgiServerFunctionsTestCase(unittest.TestCase):
     @classmethod
     def setUpClass(cls):
         cls._httpd = wsgi_boost.WsgiBoostHttp(threads=1)
-        app = App()
-        cls._httpd.set_app(app)
+        cls._app = App()
+        cls._httpd.set_app(cls._app)
         cls._server_thread = threading.Thread(target=cls._httpd.start)
         cls._server_thread.daemon = True
         cls._server_thread.start()
@@ -154,6 +159,15 @@ class WsgiServerFunctionsTestCase(unittest.TestCase):
         self.assertEqual(resp.status_code, 200)
         self.assertEqual(resp.text, 'HTTP header OK')
 
+    def test_repeated_headers(self):
+        with socket.create_connection(('127.0.0.1', 8000)) as sock:
+            sock.sendall(b'GET /test_write HTTP/1.1\r\nHost: localhost\r\nX-Foo: a\r\n'
+                         b'x-foo:  b \r\nConnection: close\r\n\r\n')
+            while sock.recv(4096):
+                pass
+        self.assertEqual(self._app.environ['HTTP_X_FOO'], 'a, b')
+        self.assertEqual(self._app.environ['HTTP_HOST'], 'localhost')
+
     def test_query_string(self):
         resp = requests.get('http://127.0.0.1:8000/test_query_string', params={'foo': 'bar'})
         self.assertEqual(resp.status_code, 200)
@@ -201,12 +215,240 @@ class WsgiServerFunctionsTestCase(unittest.TestCase):
         self.assertEqual(resp.text, 'File wrapper OK')
 
 
+def mounted_app(name):
+    def app(environ, start_response):
+        content = '{0}:{1}:{2}'.format(name, environ['SCRIPT_NAME'], environ['PATH_INFO']).encode()
+        start_response('200 OK', [('Content-type', 'text/plain'), ('Content-Length', str(len(content)))])
+        return [content]
+    return app
+
+
+class AppRoutingTestCase(unittest.TestCase):
+    @classmethod
+    def setUpClass(cls):
+        cls._httpd = wsgi_boost.WsgiBoostHttp(threads=1)
+        cls._httpd.set_app(mounted_app('default'))
+        cls._httpd.set_app(mounted_app('api'), path='/api/')
+        cls._httpd.set_app(mounted_app('api_v2'), path='/api/v2')
+        cls._httpd.set_app(mounted_app('admin'), host='admin.example.com')
+        cls._server_thread = threading.Thread(target=cls._httpd.start)
+        cls._server_thread.daemon = True
+        cls._server_thread.start()
+        time.sleep(0.5)
+
+    @classmethod
+    def tearDownClass(cls):
+        cls._httpd.stop()
+        cls._server_thread.join()
+        del cls._httpd
+        print()
+
+    def test_default_app(self):
+        resp = requests.get('http://127.0.0.1:8000/foo')
+        self.assertEqual(resp.text, 'default::/foo')
+        resp = requests.get('http://127.0.0.1:8000/apis')
+        self.assertEqual(resp.text, 'default::/apis')
+
+    def test_path_prefix(self):
+        resp = requests.get('http://127.0.0.1:8000/api')
+        self.assertEqual(resp.text, 'api:/api:')
+        resp = requests.get('http://127.0.0.1:8000/api/foo', params={'bar': 'baz'})
+        self.assertEqual(resp.text, 'api:/api:/foo')
+        resp = requests.get('http://127.0.0.1:8000/api/v2/foo')
+        self.assertEqual(resp.text, 'api_v2:/api/v2:/foo')
+
+    def test_host(self):
+        resp = requests.get('http://127.0.0.1:8000/api/foo', headers={'Host': 'Admin.Example.com:8000'})
+        self.assertEqual(resp.text, 'admin::/api/foo')
+
+    def test_tracing(self):
+        self._httpd.tracing = True
+        try:
+            requests.get('http://127.0.0.1:8000/api/traced')
+        finally:
+            self._httpd.tracing = False
+        # A trace is added after the response is sent
+        for _ in range(10):
+            traces = [trace for trace in self._httpd.get_traces() if trace['path'] == '/api/traced']
+            if traces:
+                break
+            time.sleep(0.1)
+        self.assertEqual(len(traces), 1)
+        trace = traces[0]
+        self.assertEqual(trace['method'], 'GET')
+        phases = [trace[name] for name in ('start', 'header_read', 'gil_wait', 'app_start',
+                                           'app_returned', 'first_byte', 'end')]
+        self.assertEqual(phases, sorted(phases))
+        filename = os.path.join(tempfile.mkdtemp(), 'trace.json')
+        self._httpd.dump_traces(filename)
+        with open(filename) as fo:
+            events = json.load(fo)['traceEvents']
+        self.assertTrue(any(event['name'] == 'app' for event in events))
+
+
+class AccessLogTestCase(unittest.TestCase):
+    @classmethod
+    def setUpClass(cls):
+        cls._log_dir = tempfile.mkdtemp()
+        cls._log_file = os.path.join(cls._log_dir, 'access.log')
+        cls._httpd = wsgi_boost.WsgiBoostHttp(threads=1)
+        cls._httpd.set_app(mounted_app('default'))
+        cls._httpd.access_log = cls._log_file
+        cls._server_thread = threading.Thread(target=cls._httpd.start)
+        cls._server_thread.daemon = True
+        cls._server_thread.start()
+        time.sleep(0.5)
+
+    @classmethod
+    def tearDownClass(cls):
+        cls._httpd.stop()
+        cls._server_thread.join()
+        del cls._httpd
+        print()
+
+    def read_log(self):
+        time.sleep(1.0)
+        with open(self._log_file) as fo:
+            return fo.read()
+
+    def test_access_log(self):
+        resp = requests.get('http://127.0.0.1:8000/foo?bar=baz', headers={'User-Agent': 'Test "agent"'})
+        log = self.read_log()
+        # %b is the size of the response body
+        self.assertIn('"GET /foo?bar=baz HTTP/1.1" 200 {0} '.format(len(resp.content)), log)
+        self.assertIn('"-" "Test \\"agent\\""', log)
+        self.assertTrue(log.startswith('127.0.0.1 - - ['))
+
+    @unittest.skipUnless(hasattr(signal, 'SIGHUP'), 'SIGHUP is not available')
+    def test_reopen_on_sighup(self):
+        os.rename(self._log_file, self._log_file + '.1')
+        os.kill(os.getpid(), signal.SIGHUP)
+        time.sleep(0.2)
+        requests.get('http://127.0.0.1:8000/rotated')
+        self.assertIn('/rotated', self.read_log())
+
+
+class AdmissionControlTestCase(unittest.TestCase):
+    @classmethod
+    def setUpClass(cls):
+        cls._httpd = wsgi_boost.WsgiBoostHttp(threads=1)
+        cls._httpd.set_app(mounted_app('default'))
+        cls._httpd.max_connections = 1
+        cls._httpd.retry_after = 5
+        cls._server_thread = threading.Thread(target=cls._httpd.start)
+        cls._server_thread.daemon = True
+        cls._server_thread.start()
+        time.sleep(0.5)
+
+    @classmethod
+    def tearDownClass(cls):
+        cls._httpd.stop()
+        cls._server_thread.join()
+        del cls._httpd
+        print()
+
+    def test_max_connections(self):
+        with requests.Session() as session:
+            resp = session.get('http://127.0.0.1:8000/')
+            self.assertEqual(resp.status_code, 200)
+            self.assertEqual(self._httpd.connections, 1)
+            resp = requests.get('http://127.0.0.1:8000/')
+            self.assertEqual(resp.status_code, 503)
+            self.assertEqual(resp.headers['Retry-After'], '5')
+            self.assertIn('Date', resp.headers)
+            self.assertEqual(self._httpd.shed_connections, 1)
+
+
+class RequestLimitsTestCase(unittest.TestCase):
+    @classmethod
+    def setUpClass(cls):
+        cls._httpd = wsgi_boost.WsgiBoostHttp(threads=1)
+        cls._httpd.set_app(mounted_app('default'))
+        cls._httpd.max_header_size = 1024
+        cls._httpd.max_header_count = 10
+        cls._httpd.max_body_size = 100
+        cls._server_thread = threading.Thread(target=cls._httpd.start)
+        cls._server_thread.daemon = True
+        cls._server_thread.start()
+        time.sleep(0.5)
+
+    @classmethod
+    def tearDownClass(cls):
+        cls._httpd.stop()
+        cls._server_thread.join()
+        del cls._httpd
+        print()
+
+    def test_max_header_size(self):
+        resp = requests.get('http://127.0.0.1:8000/', headers={'Foo': 'x' * 1024})
+        self.assertEqual(resp.status_code, 431)
+        resp = requests.get('http://127.0.0.1:8000/', headers={'Foo': 'x' * 512})
+        self.assertEqual(resp.status_code, 200)
+
+    def test_max_header_count(self):
+        headers = {'Foo-{0}'.format(i): 'bar' for i in range(10)}
+        resp = requests.get('http://127.0.0.1:8000/', headers=headers)
+        self.assertEqual(resp.status_code, 431)
+
+    def test_max_body_size(self):
+        resp = requests.post('http://127.0.0.1:8000/', data=b'x' * 100)
+        self.assertEqual(resp.status_code, 200)
+        # The response must not be lost if the content is sent before it is read
+        with socket.create_connection(('127.0.0.1', 8000)) as sock:
+            sock.sendall(b'POST / HTTP/1.1\r\nHost: localhost\r\nContent-Length: 100000\r\n\r\n')
+            sock.sendall(b'x' * 50000)
+            time.sleep(0.2)
+            sock.sendall(b'x' * 50000)
+            time.sleep(0.2)
+            self.assertTrue(sock.recv(4096).startswith(b'HTTP/1.1 413 Payload Too Large'))
+
+
+class KeepAliveTestCase(unittest.TestCase):
+    @classmethod
+    def setUpClass(cls):
+        cls._httpd = wsgi_boost.WsgiBoostHttp(threads=1)
+        cls._httpd.set_app(mounted_app('default'))
+        cls._httpd.keepalive_timeout = 1
+        cls._httpd.max_keepalive_requests = 2
+        cls._server_thread = threading.Thread(target=cls._httpd.start)
+        cls._server_thread.daemon = True
+        cls._server_thread.start()
+        time.sleep(0.5)
+
+    @classmethod
+    def tearDownClass(cls):
+        cls._httpd.stop()
+        cls._server_thread.join()
+        del cls._httpd
+        print()
+
+    def test_max_keepalive_requests(self):
+        with requests.Session() as session:
+            resp = session.get('http://127.0.0.1:8000/')
+            self.assertEqual(resp.headers['Connection'], 'keep-alive')
+            resp = session.get('http://127.0.0.1:8000/')
+            self.assertEqual(resp.headers['Connection'], 'close')
+            resp = session.get('http://127.0.0.1:8000/')
+            self.assertEqual(resp.status_code, 200)
+
+    def test_keepalive_timeout(self):
+        with requests.Session() as session:
+            resp = session.get('http://127.0.0.1:8000/')
+            self.assertEqual(resp.headers['Connection'], 'keep-alive')
+            self.assertEqual(self._httpd.connections, 1)
+            # Timeouts have 1s resolution
+            time.sleep(2.5)
+            self.assertEqual(self._httpd.connections, 0)
+
+
 class ServingStaticFilesTestCase(unittest.TestCase):
     @classmethod
     def setUpClass(cls):
         cls._httpd = wsgi_boost.WsgiBoostHttp(threads=1)
         cls._httpd.add_static_route('^/static', cwd)
         cls._httpd.add_static_route('^/invalid_dir', '/foo/bar/baz/')
+        cls._httpd.add_static_route(r'^/(files|assets)', cwd, preload=True)
+        cls._httpd.set_error_page(404, 'Nothing here', 'text/plain')
         cls._server_thread = threading.Thread(target=cls._httpd.start)
         cls._server_thread.daemon = True
         cls._server_thread.start()
@@ -235,17 +477,82 @@ class ServingStaticFilesTestCase(unittest.TestCase):
         resp = requests.get('http://127.0.0.1:8000/static/foo/bar.html')
         self.assertEqual(resp.status_code, 404)
 
+    def test_custom_error_page(self):
+        resp = requests.get('http://127.0.0.1:8000/static/foo/bar.html')
+        self.assertEqual(resp.status_code, 404)
+        self.assertEqual(resp.headers['Content-Type'], 'text/plain')
+        self.assertEqual(resp.text, 'Nothing here')
+        self.assertTrue('Date' in resp.headers)
+        resp = requests.get('http://127.0.0.1:8000/static/index.html',
+                            headers={'Range': 'bytes=100000-', 'Accept-Encoding': 'identity'})
+        self.assertEqual(resp.status_code, 416)
+        self.assertEqual(resp.headers['Content-Range'], 'bytes */' + str(os.path.getsize('index.html')))
+
+    def test_not_found_cache(self):
+        path = os.path.join(cwd, 'not_found_cache.txt')
+        self.addCleanup(lambda: os.path.exists(path) and os.remove(path))
+        resp = requests.get('http://127.0.0.1:8000/static/not_found_cache.txt')
+        self.assertEqual(resp.status_code, 404)
+        with open(path, 'w') as fo:
+            fo.write('Found')
+        # A missed path is served from the cache until its TTL expires
+        resp = requests.get('http://127.0.0.1:8000/static/not_found_cache.txt')
+        self.assertEqual(resp.status_code, 404)
+        time.sleep(1.1)
+        resp = requests.get('http://127.0.0.1:8000/static/not_found_cache.txt')
+        self.assertEqual(resp.status_code, 200)
+        self.assertEqual(resp.text, 'Found')
+
+    def test_regex_static_route(self):
+        resp = requests.get('http://127.0.0.1:8000/assets/index.html')
+        self.assertEqual(resp.status_code, 200)
+        self.assertTrue('Welcome to Our Company' in resp.text)
+        resp = requests.get('http://127.0.0.1:8000/STATIC/index.html')
+        self.assertEqual(resp.status_code, 200)
+
     def test_gzipping_static_files(self):
         html_size = os.path.getsize('index.html')
         resp = requests.get('http://127.0.0.1:8000/static/index.html')
         self.assertTrue(html_size > int(resp.headers['Content-Length']))
+        self.assertEqual(resp.headers['Vary'], 'Accept-Encoding')
+        # Compressed and identity variants have different ETags
+        identity = requests.get('http://127.0.0.1:8000/static/index.html', headers={'Accept-Encoding': 'identity'})
+        self.assertEqual(identity.headers['Vary'], 'Accept-Encoding')
+        self.assertEqual(resp.headers['ETag'], identity.headers['ETag'][:-1] + '-gz"')
+        resp = requests.get('http://127.0.0.1:8000/static/index.html',
+                            headers={'Accept-Encoding': 'identity', 'If-None-Match': resp.headers['ETag']})
+        self.assertEqual(resp.status_code, 200)
         png_size = os.path.getsize('profile_pic.png')
         resp = requests.get('http://127.0.0.1:8000/static/profile_pic.png')
         self.assertEqual(png_size, int(resp.headers['Content-Length']))
+        self.assertNotIn('Vary', resp.headers)
+
+    def test_preload(self):
+        # Compressed variants of files from the preloaded route are cached at start
+        self.assertGreater(self._httpd.static_cache_used, 0)
+        resp = requests.get('http://127.0.0.1:8000/files/index.html')
+        self.assertEqual(resp.headers['Content-Encoding'], 'gzip')
+        with open(os.path.join(cwd, 'index.html'), 'rb') as fo:
+            self.assertEqual(resp.content, fo.read())
+
+    def test_static_file_content(self):
+        with open(os.path.join(cwd, 'profile_pic.png'), 'rb') as fo:
+            content = fo.read()
+        resp = requests.get('http://127.0.0.1:8000/static/profile_pic.png')
+        self.assertEqual(resp.content, content)
+        self._httpd.use_sendfile = False
+        try:
+            # In-memory file cache
+            resp = requests.get('http://127.0.0.1:8000/static/profile_pic.png')
+            self.assertEqual(resp.content, content)
+            resp = requests.get('http://127.0.0.1:8000/static/profile_pic.png', headers={'Range': 'bytes=1024-2048'})
+            self.assertEqual(resp.content, content[1024:2049])
+        finally:
+            self._httpd.use_sendfile = True
 
     def test_not_modified_response(self):
         posix_time = 1419175200
-        etag = '"' + hex(posix_time)[2:] + '"'
+        etag = '"' + hex(posix_time)[2:] + '-gz"'
         os.utime(os.path.join(cwd, 'index.html'), (posix_time, posix_time))
         resp = requests.get('http://127.0.0.1:8000/static/index.html', headers={'If-Modified-Since': 'Sun, 21 Dec 2014 15:19:00 GMT'})
         self.assertEqual(resp.status_code, 200)
@@ -257,14 +564,77 @@ class ServingStaticFilesTestCase(unittest.TestCase):
         resp = requests.get('http://127.0.0.1:8000/static/index.html', headers={'If-Modified-Since': 'Mon, 21 Dec 2014 15:21:00 GMT'})
         self.assertEqual(resp.status_code, 304)
 
+    def test_content_etag(self):
+        file_path = os.path.join(cwd, 'profile_pic.png')
+        stat = os.stat(file_path)
+        self._httpd.content_etags = True
+        try:
+            resp = requests.get('http://127.0.0.1:8000/static/profile_pic.png')
+            etag = resp.headers['ETag']
+            self.assertRegex(etag, r'^"[0-9a-f]{16}"$')
+            # A new modification time with the same content keeps the ETag
+            os.utime(file_path, (stat.st_atime, stat.st_mtime - 3600))
+            resp = requests.get('http://127.0.0.1:8000/static/profile_pic.png', headers={'If-None-Match': '"foo", ' + etag})
+            self.assertEqual(resp.status_code, 304)
+            self.assertEqual(resp.headers['ETag'], etag)
+            resp = requests.get('http://127.0.0.1:8000/static/profile_pic.png', headers={'If-None-Match': '"foo"'})
+            self.assertEqual(resp.status_code, 200)
+        finally:
+            self._httpd.content_etags = False
+            os.utime(file_path, (stat.st_atime, stat.st_mtime))
+
     def test_range_header(self):
+        with open(os.path.join(cwd, 'profile_pic.png'), 'rb') as fo:
+            content = fo.read()
         resp = requests.get('http://127.0.0.1:8000/static/profile_pic.png', headers={'Range': 'bytes=1024-2048'})
         self.assertEqual(resp.status_code, 206)
         self.assertEqual(resp.headers['Content-Range'], 'bytes 1024-2048/22003')
-        self.assertEqual(resp.headers['Content-Length'], '1024')
-        self.assertEqual(len(resp.content), 1024)
-        resp = requests.get('http://127.0.0.1:8000/static/profile_pic.png', headers={'Range': 'bytes=1024-30000'})
+        self.assertEqual(resp.headers['Content-Length'], '1025')
+        self.assertEqual(resp.content, content[1024:2049])
+        resp = requests.get('http://127.0.0.1:8000/static/profile_pic.png', headers={'Range': 'bytes=-100'})
+        self.assertEqual(resp.headers['Content-Range'], 'bytes 21903-22002/22003')
+        self.assertEqual(resp.content, content[-100:])
+        resp = requests.get('http://127.0.0.1:8000/static/profile_pic.png', headers={'Range': 'bytes=22000-30000'})
+        self.assertEqual(resp.headers['Content-Range'], 'bytes 22000-22002/22003')
+        self.assertEqual(resp.content, content[22000:])
+        resp = requests.get('http://127.0.0.1:8000/static/profile_pic.png', headers={'Range': 'bytes=30000-40000'})
         self.assertEqual(resp.status_code, 416)
+        self.assertEqual(resp.headers['Content-Range'], 'bytes */22003')
+        resp = requests.get('http://127.0.0.1:8000/static/profile_pic.png', headers={'Range': 'bytes=2048-1024'})
+        self.assertEqual(resp.status_code, 200)
+        self.assertEqual(resp.content, content)
+
+    def test_multiple_ranges(self):
+        with open(os.path.join(cwd, 'profile_pic.png'), 'rb') as fo:
+            content = fo.read()
+        resp = requests.get('http://127.0.0.1:8000/static/profile_pic.png', headers={'Range': 'bytes=0-99, 1000-1099, -10'})
+        self.assertEqual(resp.status_code, 206)
+        content_type, boundary = resp.headers['Content-Type'].split('; boundary=')
+        self.assertEqual(content_type, 'multipart/byteranges')
+        self.assertEqual(len(resp.content), int(resp.headers['Content-Length']))
+        parts = resp.content.split(b'\r\n--' + boundary.encode())
+        self.assertEqual(parts[0], b'')
+        self.assertEqual(parts[-1], b'--\r\n')
+        ranges = [(0, 100), (1000, 1100), (21993, 22003)]
+        for part, (start, end) in zip(parts[1:-1], ranges):
+            part_headers, data = part.split(b'\r\n\r\n', 1)
+            self.assertIn('Content-Range: bytes {0}-{1}/22003'.format(start, end - 1).encode(), part_headers)
+            self.assertEqual(data, content[start:end])
+        # Overlapping ranges are merged
+        resp = requests.get('http://127.0.0.1:8000/static/profile_pic.png', headers={'Range': 'bytes=0-99,50-199'})
+        self.assertEqual(resp.headers['Content-Range'], 'bytes 0-199/22003')
+
+    def test_if_range_header(self):
+        resp = requests.get('http://127.0.0.1:8000/static/profile_pic.png')
+        etag = resp.headers['ETag']
+        last_modified = resp.headers['Last-Modified']
+        resp = requests.get('http://127.0.0.1:8000/static/profile_pic.png', headers={'Range': 'bytes=0-9', 'If-Range': etag})
+        self.assertEqual(resp.status_code, 206)
+        resp = requests.get('http://127.0.0.1:8000/static/profile_pic.png', headers={'Range': 'bytes=0-9', 'If-Range': last_modified})
+        self.assertEqual(resp.status_code, 206)
+        resp = requests.get('http://127.0.0.1:8000/static/profile_pic.png', headers={'Range': 'bytes=0-9', 'If-Range': '"foo"'})
+        self.assertEqual(resp.status_code, 200)
+        self.assertEqual(len(resp.content), 22003)
 
 
 try:
@@ -282,6 +652,7 @@ else:
             app = App()
             cls._httpd.redirect_http = True
             cls._httpd.redirect_http_port = 8000
+            cls._httpd.max_handshakes = 1
             cls._httpd.set_app(app)
             cls._server_thread = threading.Thread(target=cls._httpd.start)
             cls._server_thread.daemon = True
@@ -305,6 +676,69 @@ else:
             self.assertEqual(resp.status_code, 200)
             self.assertEqual(resp.text, 'App OK')
 
+        def test_redirect_location(self):
+            resp = requests.get('http://127.0.0.1:8000/foo?bar=baz', headers={'Host': 'example.com:8000'},
+                                allow_redirects=False)
+            self.assertEqual(resp.status_code, 301)
+            self.assertEqual(resp.headers['Location'], 'https://example.com:4443/foo?bar=baz')
+            with socket.create_connection(('127.0.0.1', 8000)) as sock:
+                sock.sendall(b'GET / HTTP/1.1\r\nAccept: */*\r\n\r\n')
+                self.assertTrue(sock.recv(4096).startswith(b'HTTP/1.1 400 Bad Request'))
+            # Bare LF in the target or the host must not split the response
+            for request in (b'GET /\nSet-Cookie: injected=1 HTTP/1.1\r\nHost: example.com\r\n\r\n',
+                            b'GET / HTTP/1.1\r\nHost: example.com\nX-Injected: 1\r\n\r\n',
+                            b'GET / HTTP/1.1\r\nHost: exa mple.com\r\n\r\n'):
+                with socket.create_connection(('127.0.0.1', 8000)) as sock:
+                    sock.sendall(request)
+                    self.assertTrue(sock.recv(4096).startswith(b'HTTP/1.1 400 Bad Request'))
+
+        def test_queued_handshakes(self):
+            results = []
+
+            def get():
+                resp = requests.get('https://127.0.0.1:4443/', verify=False)
+                results.append(resp.status_code)
+
+            threads = [threading.Thread(target=get) for _ in range(4)]
+            for thread in threads:
+                thread.start()
+            for thread in threads:
+                thread.join()
+            self.assertEqual(results, [200] * 4)
+
+        def test_idle_connection_does_not_block_handshakes(self):
+            with socket.create_connection(('127.0.0.1', 4443)):
+                started = time.time()
+                resp = requests.get('https://127.0.0.1:4443/', verify=False)
+                self.assertEqual(resp.status_code, 200)
+                self.assertLess(time.time() - started, 2)
+
+        def test_ecdhe_cipher(self):
+            context = ssl.SSLContext(ssl.PROTOCOL_TLS_CLIENT)
+            context.check_hostname = False
+            context.verify_mode = ssl.CERT_NONE
+            context.maximum_version = ssl.TLSVersion.TLSv1_2
+            with socket.create_connection(('127.0.0.1', 4443)) as sock:
+                with context.wrap_socket(sock) as ssl_sock:
+                    self.assertTrue(ssl_sock.cipher()[0].startswith('ECDHE-'))
+
+        def test_session_resumption(self):
+            context = ssl.SSLContext(ssl.PROTOCOL_TLS_CLIENT)
+            context.check_hostname = False
+            context.verify_mode = ssl.CERT_NONE
+            session = None
+            session_reused = False
+            for _ in range(2):
+                with socket.create_connection(('127.0.0.1', 4443)) as sock:
+                    with context.wrap_socket(sock, session=session) as ssl_sock:
+                        ssl_sock.sendall(b'GET / HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n')
+                        while ssl_sock.recv(4096):
+                            pass
+                        session = ssl_sock.session
+                        session_reused = ssl_sock.session_reused
+            self.assertTrue(session_reused)
+            self.assertTrue(self._httpd.session_stats()['hits'] >= 1)
+
 
 if __name__ == '__main__':
     unittest.main()
\ No newline at end of file
@@ -0,0 +1,429 @@
+#pragma once
+/*
+Asynchronous access log
+
+Copyright (c) 2017 Roman Miroshnychenko <romanvm@yandex.ua>
+License: MIT, see License.txt
+*/
+
+#include <boost/asio.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+
+namespace wsgi_boost
+{
+	// Common Log Format with Referer and User-Agent
+	const std::string default_access_log_format = "%h - - %t \"%r\" %s %b \"%{Referer}i\" \"%{User-Agent}i\"";
+
+
+	// Lock-free byte ring buffer for one producer and one consumer thread
+	class LogBuffer
+	{
+	private:
+		std::vector<char> m_data;
+		std::atomic<size_t> m_head; // Written only by the producer
+		std::atomic<size_t> m_tail; // Written only by the consumer
+
+	public:
+		explicit LogBuffer(size_t capacity) : m_data(capacity)
+		{
+			m_head.store(0);
+			m_tail.store(0);
+		}
+
+		LogBuffer(const LogBuffer&) = delete;
+		LogBuffer& operator=(const LogBuffer&) = delete;
+
+		// Add data if there is enough free space
+		bool push(const char* data, size_t length)
+		{
+			size_t head = m_head.load(std::memory_order_relaxed);
+			size_t tail = m_tail.load(std::memory_order_acquire);
+			if (m_data.size() - (head - tail) < length)
+				return false;
+			size_t pos = head % m_data.size();
+			size_t first = std::min(length, m_data.size() - pos);
+			std::memcpy(&m_data[pos], data, first);
+			std::memcpy(&m_data[0], data + first, length - first);
+			m_head.store(head + length, std::memory_order_release);
+			return true;
+		}
+
+		// Move all buffered data to the end of a string
+		void pop_all(std::string& out)
+		{
+			size_t tail = m_tail.load(std::memory_order_relaxed);
+			size_t head = m_head.load(std::memory_order_acquire);
+			size_t length = head - tail;
+			if (length == 0)
+				return;
+			size_t pos = tail % m_data.size();
+			size_t first = std::min(length, m_data.size() - pos);
+			out.append(&m_data[pos], first);
+			out.append(&m_data[0], length - first);
+			m_tail.store(head, std::memory_order_release);
+		}
+	};
+
+
+	// Access log with a configurable line format
+	//
+	// io_service threads format lines into their own lock-free buffers,
+	// and a background thread writes buffered lines to a file in large batches,
+	// so request processing never waits for disk I/O. If a buffer is full
+	// the line is dropped and counted.
+	//
+	// Format directives:
+	// %h - remote address, %t - time in Common Log Format, %r - request line,
+	// %m - method, %U - path without query, %q - query string with '?', %H - protocol,
+	// %s - status code, %b - body bytes sent or '-' for none, %O - bytes sent including headers,
+	// %D - request time in microseconds, %{Name}i - request header, %% - percent sign.
+	class AccessLog
+	{
+	private:
+		enum TokenType { LITERAL, REMOTE_ADDR, TIME, REQUEST_LINE, METHOD, PATH, QUERY, PROTOCOL, STATUS, BODY_BYTES, BYTES, DURATION, HEADER };
+
+		struct Token
+		{
+			TokenType type;
+			std::string text;
+		};
+
+		static const size_t buffer_size = 1048576;
+
+		std::vector<Token> m_tokens;
+		std::string m_filename;
+		std::FILE* m_file = nullptr;
+		std::unordered_map<std::thread::id, std::unique_ptr<LogBuffer>> m_buffers;
+		std::mutex m_mutex;
+		std::condition_variable m_cv;
+		std::thread m_thread;
+		bool m_stop = false;
+		std::atomic_bool m_enabled;
+		std::atomic_bool m_reopen;
+		std::atomic<unsigned long long> m_dropped;
+		unsigned int m_id;
+
+		void parse_format(const std::string& format)
+		{
+			m_tokens.clear();
+			std::string literal;
+			for (size_t i = 0; i < format.length(); ++i)
+			{
+				if (format[i] != '%' || i + 1 == format.length())
+				{
+					literal += format[i];
+					continue;
+				}
+				char ch = format[++i];
+				Token token{ LITERAL, std::string() };
+				switch (ch)
+				{
+				case 'h': token.type = REMOTE_ADDR; break;
+				case 't': token.type = TIME; break;
+				case 'r': token.type = REQUEST_LINE; break;
+				case 'm': token.type = METHOD; break;
+				case 'U': token.type = PATH; break;
+				case 'q': token.type = QUERY; break;
+				case 'H': token.type = PROTOCOL; break;
+				case 's': token.type = STATUS; break;
+				case 'b': token.type = BODY_BYTES; break;
+				case 'O': token.type = BYTES; break;
+				case 'D': token.type = DURATION; break;
+				case '%':
+					literal += '%';
+					continue;
+				case '{':
+				{
+					size_t end = format.find("}i", i);
+					if (end == std::string::npos)
+						throw std::invalid_argument("Invalid access log format: " + format);
+					token.type = HEADER;
+					token.text = format.substr(i + 1, end - i - 1);
+					i = end + 1;
+					break;
+				}
+				default:
+					throw std::invalid_argument("Invalid access log format: " + format);
+				}
+				if (!literal.empty())
+					m_tokens.push_back(Token{ LITERAL, literal });
+				literal.clear();
+				m_tokens.push_back(token);
+			}
+			if (!literal.empty())
+				m_tokens.push_back(Token{ LITERAL, literal });
+		}
+
+		void open_file()
+		{
+			if (m_filename == "-")
+			{
+				m_file = stdout;
+				return;
+			}
+			m_file = std::fopen(m_filename.c_str(), "ab");
+			if (!m_file)
+				throw std::runtime_error("Unable to open access log file " + m_filename + "!");
+		}
+
+		void close_file()
+		{
+			if (m_file && m_file != stdout)
+				std::fclose(m_file);
+			m_file = nullptr;
+		}
+
+		// Get the buffer of the current thread
+		LogBuffer* thread_buffer()
+		{
+			struct Cache
+			{
+				unsigned int log_id;
+				LogBuffer* buffer;
+			};
+			thread_local Cache cache{ 0, nullptr };
+			if (cache.log_id != m_id)
+			{
+				std::lock_guard<std::mutex> lock{ m_mutex };
+				auto& buffer = m_buffers[std::this_thread::get_id()];
+				if (!buffer)
+					buffer.reset(new LogBuffer{ buffer_size });
+				cache.log_id = m_id;
+				cache.buffer = buffer.get();
+			}
+			return cache.buffer;
+		}
+
+		// Current time in Common Log Format, cached for one second per thread
+		static const std::string& log_time()
+		{
+			thread_local time_t cached_time = 0;
+			thread_local std::string cached_string;
+			time_t now = std::time(nullptr);
+			if (now != cached_time)
+			{
+				char buffer[40];
+				std::strftime(buffer, sizeof(buffer), "[%d/%b/%Y:%H:%M:%S +0000]", std::gmtime(&now));
+				cached_string = buffer;
+				cached_time = now;
+			}
+			return cached_string;
+		}
+
+		// Append a value escaping quotes, backslashes and control characters
+		static void append_escaped(std::string& line, const std::string& value, size_t pos = 0, size_t end = std::string::npos)
+		{
+			end = std::min(end, value.length());
+			for (; pos < end; ++pos)
+			{
+				unsigned char ch = static_cast<unsigned char>(value[pos]);
+				if (ch == '"' || ch == '\\')
+				{
+					line += '\\';
+					line += static_cast<char>(ch);
+				}
+				else if (ch < 0x20 || ch == 0x7f)
+				{
+					char buffer[8];
+					std::snprintf(buffer, sizeof(buffer), "\\x%02x", ch);
+					line += buffer;
+				}
+				else
+				{
+					line += static_cast<char>(ch);
+				}
+			}
+		}
+
+		static void append_value(std::string& line, const std::string& value)
+		{
+			if (value.empty())
+				line += '-';
+			else
+				append_escaped(line, value);
+		}
+
+		void run()
+		{
+			std::string data;
+			std::unique_lock<std::mutex> lock{ m_mutex };
+			while (true)
+			{
+				m_cv.wait_for(lock, std::chrono::milliseconds(500), [this]() { return m_stop; });
+				bool stop = m_stop;
+				for (auto& buffer : m_buffers)
+					buffer.second->pop_all(data);
+				lock.unlock();
+				if (m_reopen.exchange(false))
+				{
+					if (m_file)
+						std::fflush(m_file);
+					close_file();
+					try
+					{
+						open_file();
+					}
+					catch (const std::runtime_error& ex)
+					{
+						std::cerr << ex.what() << '\n';
+					}
+				}
+				if (!data.empty() && m_file)
+				{
+					std::fwrite(data.data(), 1, data.length(), m_file);
+					std::fflush(m_file);
+				}
+				data.clear();
+				lock.lock();
+				if (stop)
+					break;
+			}
+		}
+
+		static unsigned int next_id()
+		{
+			static std::atomic<unsigned int> counter{ 0 };
+			return ++counter;
+		}
+
+	public:
+		AccessLog() : m_id{ next_id() }
+		{
+			m_enabled.store(false);
+			m_reopen.store(false);
+			m_dropped.store(0);
+		}
+
+		AccessLog(const AccessLog&) = delete;
+		AccessLog& operator=(const AccessLog&) = delete;
+
+		~AccessLog() { stop(); }
+
+		// Open a log file ("-" for stdout) and start the writer thread
+		void start(const std::string& filename, const std::string& format)
+		{
+			stop();
+			parse_format(format);
+			m_filename = filename;
+			open_file();
+			m_stop = false;
+			m_thread = std::thread{ [this]() { run(); } };
+			m_enabled.store(true);
+		}
+
+		// Write remaining lines, stop the writer thread and close the log file
+		//
+		// Thread buffers are freed, so no other thread may log lines during the call.
+		void stop()
+		{
+			if (!m_thread.joinable())
+				return;
+			m_enabled.store(false);
+			{
+				std::lock_guard<std::mutex> lock{ m_mutex };
+				m_stop = true;
+			}
+			m_cv.notify_one();
+			m_thread.join();
+			close_file();
+			// Threads of the next run get new buffers, and a new id invalidates
+			// buffer pointers cached by threads that outlive this run
+			m_buffers.clear();
+			m_id = next_id();
+		}
+
+		// Re-open the log file, e.g. after rotation
+		void reopen() { m_reopen.store(true); }
+
+		bool enabled() const { return m_enabled.load(std::memory_order_relaxed); }
+
+		// Get the number of lines dropped because of full buffers
+		unsigned long long dropped() const { return m_dropped.load(); }
+
+		// Format and buffer a log line
+		template <class req_t, class resp_t>
+		void log(const req_t& request, const resp_t& response, long long duration_us)
+		{
+			thread_local std::string line;
+			line.clear();
+			for (const auto& token : m_tokens)
+			{
+				switch (token.type)
+				{
+				case LITERAL:
+					line += token.text;
+					break;
+				case REMOTE_ADDR:
+				{
+					boost::system::error_code ec;
+					auto endpoint = request.connection().socket()->lowest_layer().remote_endpoint(ec);
+					append_value(line, ec ? std::string() : endpoint.address().to_string());
+					break;
+				}
+				case TIME:
+					line += log_time();
+					break;
+				case REQUEST_LINE:
+					append_escaped(line, request.method);
+					line += ' ';
+					append_escaped(line, request.path);
+					line += ' ';
+					append_escaped(line, request.http_version);
+					break;
+				case METHOD:
+					append_escaped(line, request.method);
+					break;
+				case PATH:
+					append_escaped(line, request.path, 0, request.path.find('?'));
+					break;
+				case QUERY:
+					append_escaped(line, request.path, std::min(request.path.find('?'), request.path.length()));
+					break;
+				case PROTOCOL:
+					append_escaped(line, request.http_version);
+					break;
+				case STATUS:
+					line += std::to_string(response.status_code);
+					break;
+				case BODY_BYTES:
+				{
+					size_t bytes = response.body_bytes_sent();
+					if (bytes > 0)
+						line += std::to_string(bytes);
+					else
+						line += '-';
+					break;
+				}
+				case BYTES:
+					line += std::to_string(response.bytes_sent());
+					break;
+				case DURATION:
+					line += std::to_string(duration_us);
+					break;
+				case HEADER:
+					append_value(line, request.get_header(token.text));
+					break;
+				}
+			}
+			line += '\n';
+			if (!thread_buffer()->push(line.data(), line.length()))
+				++m_dropped;
+		}
+	};
+}
@@ -0,0 +1,29 @@
+#pragma once
+/*
+Base class for custom Asio services
+
+Copyright (c) 2017 Roman Miroshnychenko <romanvm@yandex.ua>
+License: MIT, see License.txt
+*/
+
+#include <boost/asio.hpp>
+
+
+namespace wsgi_boost
+{
+	// Base class for a service that is attached to an io_service with boost::asio::use_service<T>()
+	//
+	// Each derived class gets its own service id. The id is a static member of a class template,
+	// so it can be defined in the header.
+	template <class T>
+	class AsioService : public boost::asio::io_service::service
+	{
+	public:
+		static boost::asio::io_service::id id;
+
+		explicit AsioService(boost::asio::io_service& io_service) : boost::asio::io_service::service(io_service) {}
+	};
+
+	template <class T>
+	boost::asio::io_service::id AsioService<T>::id;
+}
@@ -0,0 +1,91 @@
+#pragma once
+/*
+Thread pool for blocking file operations
+
+Copyright (c) 2017 Roman Miroshnychenko <romanvm@yandex.ua>
+License: MIT, see License.txt
+*/
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+namespace wsgi_boost
+{
+	// A small pool of threads for blocking operations, e.g. file reads,
+	// that must not stall an io_service thread
+	class BlockingPool
+	{
+	private:
+		std::vector<std::thread> m_threads;
+		std::deque<std::function<void()>> m_tasks;
+		std::mutex m_mutex;
+		std::condition_variable m_cv;
+		bool m_stop = false;
+
+		void run()
+		{
+			std::unique_lock<std::mutex> lock{ m_mutex };
+			while (true)
+			{
+				m_cv.wait(lock, [this]() { return m_stop || !m_tasks.empty(); });
+				if (m_tasks.empty())
+					break; // Stopped and all tasks are done
+				std::function<void()> task = std::move(m_tasks.front());
+				m_tasks.pop_front();
+				lock.unlock();
+				task();
+				lock.lock();
+			}
+		}
+
+	public:
+		BlockingPool() {}
+
+		BlockingPool(const BlockingPool&) = delete;
+		BlockingPool& operator=(const BlockingPool&) = delete;
+
+		~BlockingPool() { stop(); }
+
+		// Start a number of threads, 0 - no threads
+		void start(unsigned int threads)
+		{
+			if (m_threads.size() == threads)
+				return;
+			stop();
+			m_stop = false;
+			for (unsigned int i = 0; i < threads; ++i)
+				m_threads.emplace_back([this]() { run(); });
+		}
+
+		// Wait for queued tasks to complete and stop threads
+		void stop()
+		{
+			{
+				std::lock_guard<std::mutex> lock{ m_mutex };
+				m_stop = true;
+			}
+			m_cv.notify_all();
+			for (auto& thread : m_threads)
+				thread.join();
+			m_threads.clear();
+		}
+
+		// Add a task to the queue
+		void post(std::function<void()> task)
+		{
+			{
+				std::lock_guard<std::mutex> lock{ m_mutex };
+				m_tasks.push_back(std::move(task));
+			}
+			m_cv.notify_one();
+		}
+
+		// Get the number of threads
+		size_t size() const { return m_threads.size(); }
+	};
+}
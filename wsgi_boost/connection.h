@@ -7,16 +7,74 @@ License: MIT, see License.txt
 */
 
 #include "utils.h"
+#include "timer_wheel.h"
+#include "io_service_pool.h"
+#include "blocking_pool.h"
 
 #include <boost/asio.hpp>
 #include <boost/asio/spawn.hpp>
 
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <exception>
+#include <functional>
 #include <memory>
 #include <iostream>
 #include <string>
+#include <type_traits>
+
+#ifdef __linux__
+#include <sys/sendfile.h>
+#include <unistd.h>
+#include <cerrno>
+#endif
 
 namespace wsgi_boost
 {
+	// Socket type properties, TLS sockets are specialized in server_https.h
+	template <class socket_p>
+	struct socket_traits
+	{
+		static const bool is_tls = false;
+
+		// Set the max. size of outgoing TLS records
+		static void set_max_record_size(socket_p&, size_t) {}
+	};
+
+	// Match condition for async_read_until that finds the end of a HTTP header
+	// or stops reading when the input buffer exceeds a size limit
+	class HeaderEndMatcher
+	{
+	private:
+		const boost::asio::streambuf* m_buffer;
+		size_t m_max_size;
+		bool* m_exceeded;
+
+	public:
+		typedef boost::asio::buffers_iterator<boost::asio::streambuf::const_buffers_type> iterator;
+		typedef std::pair<iterator, bool> result_type;
+
+		HeaderEndMatcher(const boost::asio::streambuf& buffer, size_t max_size, bool& exceeded) :
+			m_buffer{ &buffer }, m_max_size{ max_size }, m_exceeded{ &exceeded } {}
+
+		result_type operator()(iterator begin, iterator end) const
+		{
+			const char delimiter[] = "\r\n\r\n";
+			iterator found = std::search(begin, end, delimiter, delimiter + 4);
+			if (found != end)
+				return result_type{ found + 4, true };
+			if (m_max_size > 0 && m_buffer->size() > m_max_size)
+			{
+				*m_exceeded = true;
+				return result_type{ end, true };
+			}
+			// A partial delimiter at the end is searched again after the next read
+			return result_type{ end - std::min<std::ptrdiff_t>(end - begin, 3), false };
+		}
+	};
+
+
 	// Represents a http connection to a client
 	template <class socket_p>
 	class Connection
@@ -25,25 +83,96 @@ namespace wsgi_boost
 		socket_p m_socket;
 		boost::asio::streambuf m_istreambuf;
 		boost::asio::streambuf m_ostreambuf;
-		boost::asio::deadline_timer m_timer;
+		TimerWheel& m_timer_wheel;
+		TimerWheel::Timeout m_timeout;
 		unsigned int m_header_timeout;
 		unsigned int m_content_timeout;
 		long long m_bytes_left = -1;
 		long long m_content_length = -1;
 		boost::asio::yield_context m_yc;
+		// Dynamic TLS record sizing: small records at the start of a connection
+		// fit into one TCP segment and can be decrypted by a client as soon as they arrive,
+		// full-size records reduce framing and encryption overhead for bulk data.
+		static const size_t small_record_size = 1400;
+		static const size_t large_record_size = 16384;
+		static const size_t small_records_bytes = 131072;
+		size_t m_bytes_sent = 0;
+		size_t m_small_records_start = 0; // m_bytes_sent when small records were set
+		bool m_large_records = false;
 
 		void set_timeout(unsigned int timeout)
 		{
-			m_timer.expires_from_now(boost::posix_time::seconds(timeout));
-			m_timer.async_wait([this](const boost::system::error_code& ec)
+			m_timer_wheel.schedule(m_timeout, timeout, [this]()
+			{
+				boost::system::error_code ec;
+				m_socket->lowest_layer().shutdown(boost::asio::ip::tcp::socket::shutdown_both, ec);
+				m_socket->lowest_layer().close(ec);
+			});
+		}
+
+		void update_record_size()
+		{
+			if (socket_traits<socket_p>::is_tls && !m_large_records && m_bytes_sent - m_small_records_start >= small_records_bytes)
+			{
+				socket_traits<socket_p>::set_max_record_size(m_socket, large_record_size);
+				m_large_records = true;
+			}
+		}
+
+#ifdef __linux__
+		// Send a file through the output buffer
+		boost::system::error_code send_file(int fd, off_t offset, size_t length, std::true_type)
+		{
+			const size_t chunk_size = 131072;
+			boost::system::error_code ec;
+			while (length > 0 && !ec)
 			{
-				if (ec != boost::asio::error::operation_aborted)
+				size_t size = length < chunk_size ? length : chunk_size;
+				ssize_t bytes_read = ::pread(fd, boost::asio::buffer_cast<char*>(m_ostreambuf.prepare(size)), size, offset);
+				if (bytes_read <= 0)
+					return boost::asio::error::eof; // The file has been truncated or can not be read
+				m_ostreambuf.commit(bytes_read);
+				offset += bytes_read;
+				length -= bytes_read;
+				ec = flush();
+			}
+			return ec;
+		}
+
+		// Send a file with sendfile()
+		boost::system::error_code send_file(int fd, off_t offset, size_t length, std::false_type)
+		{
+			boost::system::error_code ec;
+			m_socket->non_blocking(true, ec);
+			while (length > 0 && !ec)
+			{
+				ssize_t bytes_sent = ::sendfile(m_socket->native_handle(), fd, &offset, length);
+				if (bytes_sent > 0)
 				{
-					m_socket->lowest_layer().shutdown(boost::asio::ip::tcp::socket::shutdown_both);
-					m_socket->lowest_layer().close();
+					length -= bytes_sent;
+					m_bytes_sent += bytes_sent;
 				}
-			});
+				else if (bytes_sent == 0)
+				{
+					ec = boost::asio::error::eof;
+				}
+				else if (errno == EAGAIN || errno == EWOULDBLOCK)
+				{
+					// Wait until the socket is ready for writing
+					set_timeout(m_content_timeout);
+					m_socket->async_write_some(boost::asio::null_buffers(), m_yc[ec]);
+					m_timeout.cancel();
+				}
+				else if (errno != EINTR)
+				{
+					ec = boost::system::error_code(errno, boost::system::system_category());
+				}
+			}
+			boost::system::error_code ignored_ec;
+			m_socket->non_blocking(false, ignored_ec);
+			return ec;
 		}
+#endif
 
 	public:
 		Connection(const Connection&) = delete;
@@ -51,16 +180,27 @@ namespace wsgi_boost
 
 		Connection(socket_p socket, boost::asio::yield_context yc,
 				unsigned int header_timeout, unsigned int content_timeout) :
-			m_socket{ socket }, m_timer{ socket->get_io_service() }, m_yc{ yc },
-			m_header_timeout{ header_timeout }, m_content_timeout{ content_timeout } {}
+			m_socket{ socket }, m_timer_wheel{ boost::asio::use_service<TimerWheel>(get_io_service(*socket)) }, m_yc{ yc },
+			m_header_timeout{ header_timeout }, m_content_timeout{ content_timeout }
+		{
+			// Records also start small again after an idle keep-alive period, see wait_for_input()
+			if (socket_traits<socket_p>::is_tls)
+				socket_traits<socket_p>::set_max_record_size(m_socket, small_record_size);
+		}
 
 		// Read HTTP header
-		boost::system::error_code read_header(std::string& header)
+		//
+		// Returns message_size error as soon as the header exceeds max_size bytes, 0 - no limit.
+		boost::system::error_code read_header(std::string& header, size_t max_size = 0)
 		{
 			boost::system::error_code ec;
+			bool exceeded = false;
 			set_timeout(m_header_timeout);
-			size_t bytes_read = boost::asio::async_read_until(*m_socket, m_istreambuf, "\r\n\r\n", m_yc[ec]);
-			m_timer.cancel();
+			size_t bytes_read = boost::asio::async_read_until(*m_socket, m_istreambuf,
+				HeaderEndMatcher{ m_istreambuf, max_size, exceeded }, m_yc[ec]);
+			m_timeout.cancel();
+			if (!ec && (exceeded || (max_size > 0 && bytes_read > max_size)))
+				ec = boost::asio::error::message_size;
 			if (!ec)
 			{
 				auto in_buffer = m_istreambuf.data();
@@ -91,7 +231,7 @@ namespace wsgi_boost
 				set_timeout(m_content_timeout); // Timer works only for async operations
 				bytes_read = boost::asio::async_read(*m_socket, m_istreambuf,
 					boost::asio::transfer_exactly(size), m_yc[ec]);
-				m_timer.cancel();
+				m_timeout.cancel();
 			}				
 			else
 			{
@@ -158,26 +298,167 @@ namespace wsgi_boost
 		// Get POST content length
 		long long post_content_length() const { return m_content_length; }
 
+		// Check if POST content has been read completely
+		bool content_consumed() const { return m_bytes_left <= 0; }
+
+		// Check if the input buffer contains data that has not been read yet
+		bool has_buffered_input() const { return m_istreambuf.size() > 0; }
+
+		// Wait for the first bytes of the next request on a keep-alive connection
+		//
+		// The header itself is then read with the header timeout.
+		boost::system::error_code wait_for_input(unsigned int timeout)
+		{
+			boost::system::error_code ec;
+			if (has_buffered_input())
+				return ec;
+			auto started = std::chrono::steady_clock::now();
+			set_timeout(timeout);
+			size_t bytes_read = m_socket->async_read_some(m_istreambuf.prepare(4096), m_yc[ec]);
+			m_timeout.cancel();
+			m_istreambuf.commit(bytes_read);
+			// TCP congestion window may be reset after an idle period,
+			// so TLS records start small again
+			if (socket_traits<socket_p>::is_tls && m_large_records &&
+				std::chrono::steady_clock::now() - started >= std::chrono::seconds(1))
+			{
+				socket_traits<socket_p>::set_max_record_size(m_socket, small_record_size);
+				m_large_records = false;
+				m_small_records_start = m_bytes_sent;
+			}
+			return ec;
+		}
+
 		// Save data to the output buffer
-		void buffer_output(const std::string& data)
+		void buffer_output(const char* data, size_t length)
 		{
-			size_t length = data.length();
 			auto out_buffers = m_ostreambuf.prepare(length);
-			auto buffers_begin = boost::asio::buffers_begin(out_buffers);
-			std::copy(data.begin(), data.end(), buffers_begin);
+			boost::asio::buffer_copy(out_buffers, boost::asio::buffer(data, length));
 			m_ostreambuf.commit(length);
 		}
 
+		void buffer_output(const std::string& data)
+		{
+			buffer_output(data.data(), data.length());
+		}
+
 		// Send all output data to the client
+		//
+		// All buffered data are sent in one write, so on a TLS socket
+		// OpenSSL gets one large buffer instead of a separate buffer per record.
 		boost::system::error_code flush()
 		{
 			boost::system::error_code ec;
+			if (m_ostreambuf.size() == 0)
+				return ec;
+			update_record_size();
 			set_timeout(m_content_timeout);
-			boost::asio::async_write(*m_socket, m_ostreambuf, m_yc[ec]);
-			m_timer.cancel();	
+			m_bytes_sent += boost::asio::async_write(*m_socket, m_ostreambuf, m_yc[ec]);
+			m_timeout.cancel();
+			return ec;
+		}
+
+		// Send data from memory that outlives the call, e.g. a cached file,
+		// without copying it into the output buffer
+		//
+		// Buffered output is sent in the same write. TLS sockets get the data
+		// in parts of small_records_bytes to switch to full-size records on time.
+		boost::system::error_code send_buffer(const char* data, size_t length)
+		{
+			boost::system::error_code ec;
+			if (socket_traits<socket_p>::is_tls && m_ostreambuf.size() > 0)
+			{
+				// OpenSSL encrypts each buffer separately, so the header is
+				// topped up with the beginning of the data to fill a record.
+				size_t size = m_ostreambuf.size() < large_record_size ? large_record_size - m_ostreambuf.size() : 0;
+				size = std::min(size, length);
+				buffer_output(data, size);
+				data += size;
+				length -= size;
+				ec = flush();
+			}
+			while (length > 0 && !ec)
+			{
+				size_t size = socket_traits<socket_p>::is_tls ? std::min(length, small_records_bytes) : length;
+				update_record_size();
+				std::array<boost::asio::const_buffer, 2> buffers = { { m_ostreambuf.data(), boost::asio::buffer(data, size) } };
+				set_timeout(m_content_timeout);
+				m_bytes_sent += boost::asio::async_write(*m_socket, buffers, m_yc[ec]);
+				m_timeout.cancel();
+				m_ostreambuf.consume(m_ostreambuf.size());
+				data += size;
+				length -= size;
+			}
 			return ec;
 		}
 
+#ifdef __linux__
+		// Send a part of a file to the client
+		//
+		// Plain TCP sockets use zero-copy sendfile(). Data for TLS sockets
+		// must be encrypted by OpenSSL, so the file is read directly into the output buffer.
+		boost::system::error_code send_file(int fd, off_t offset, size_t length)
+		{
+			boost::system::error_code ec = flush();
+			if (ec)
+				return ec;
+			return send_file(fd, offset, length, std::integral_constant<bool, socket_traits<socket_p>::is_tls>());
+		}
+#endif
+
+		// Run a blocking function on a thread pool, the coroutine yields until the function returns
+		//
+		// Other connections on the same io_service keep progressing meanwhile.
+		// The function is called in place if the pool has no threads.
+		// An exception thrown by the function is re-thrown in the coroutine.
+		void run_blocking(BlockingPool& pool, const std::function<void()>& func)
+		{
+			if (pool.size() == 0)
+			{
+				func();
+				return;
+			}
+			boost::asio::io_service& io_service = get_io_service(*m_socket);
+			// A timer that never expires is used as an event: the pool thread cancels it.
+			// The cancellation is posted to the io_service, so it runs only after
+			// the coroutine has started waiting.
+			boost::asio::deadline_timer event{ io_service, boost::posix_time::ptime{ boost::posix_time::pos_infin } };
+			std::exception_ptr exception;
+			pool.post([&io_service, &event, &func, &exception]()
+			{
+				try
+				{
+					func();
+				}
+				catch (...)
+				{
+					exception = std::current_exception();
+				}
+				io_service.post([&event]()
+				{
+					boost::system::error_code ec;
+					event.cancel(ec);
+				});
+			});
+			boost::system::error_code ec;
+			event.async_wait(m_yc[ec]);
+			if (exception)
+				std::rethrow_exception(exception);
+		}
+
+		// Check if files can be sent with zero-copy send_file()
+		static bool sendfile_supported()
+		{
+#ifdef __linux__
+			return !socket_traits<socket_p>::is_tls;
+#else
+			return false;
+#endif
+		}
+
+		// Get the number of bytes sent through the connection
+		size_t bytes_sent() const { return m_bytes_sent; }
+
 		// Get asio socket pointer
 		socket_p socket() const { return m_socket; }
 	};
@@ -0,0 +1,119 @@
+#pragma once
+/*
+Pre-rendered error responses
+
+Copyright (c) 2017 Roman Miroshnychenko <romanvm@yandex.ua>
+License: MIT, see License.txt
+*/
+
+#include "utils.h"
+
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+
+namespace wsgi_boost
+{
+	// An error response serialized except for the protocol version and Date header
+	struct ErrorPage
+	{
+		int status_code;
+		std::string head; // Status line without protocol version and fixed headers
+		std::string keep_alive; // Connection header, the end of the header and the body
+		std::string close;
+	};
+
+
+	// Error responses that are rendered once at server start,
+	// so error storms do not format pages for each request
+	//
+	// Each status has a default body that can be replaced with a custom one.
+	class ErrorPages
+	{
+	private:
+		struct Body
+		{
+			int status_code;
+			const char* status;
+			std::string content_type;
+			std::string content;
+		};
+
+		std::vector<Body> m_bodies;
+		std::vector<ErrorPage> m_pages;
+
+		Body* find_body(int status_code)
+		{
+			for (auto& body : m_bodies)
+			{
+				if (body.status_code == status_code)
+					return &body;
+			}
+			return nullptr;
+		}
+
+		static Body html_body(int status_code, const char* status, const char* header, const char* text)
+		{
+			return Body{ status_code, status, "text/html",
+				render_html("Error " + std::to_string(status_code), header, text) };
+		}
+
+	public:
+		ErrorPages()
+		{
+			m_bodies.push_back(Body{ 400, "400 Bad Request", "text/plain", "Malformed HTTP request!" });
+			m_bodies.push_back(html_body(404, "404 Not Found", "Not Found", "The requested path was not found on this server."));
+			m_bodies.push_back(Body{ 405, "405 Method Not Allowed", "text/plain", "Invalid HTTP method! Only GET and HEAD are allowed." });
+			m_bodies.push_back(Body{ 411, "411 Length Required", "text/plain", "Content-Length header is missing!" });
+			m_bodies.push_back(Body{ 413, "413 Payload Too Large", "text/plain", "Request content is too large!" });
+			m_bodies.push_back(Body{ 416, "416 Range Not Satisfiable", "text/plain", "Invalid bytes range!" });
+			m_bodies.push_back(Body{ 431, "431 Request Header Fields Too Large", "text/plain", "Request header is too large!" });
+			m_bodies.push_back(html_body(500, "500 Internal Server Error", "Internal Server Error", "The server encountered an internal error."));
+			m_bodies.push_back(Body{ 503, "503 Service Unavailable", "text/plain", "The server is overloaded. Please try again later." });
+			render(1);
+		}
+
+		// Set a custom body for an error status code, pages must be rendered again to use it
+		void set_body(int status_code, const std::string& content, const std::string& content_type)
+		{
+			Body* body = find_body(status_code);
+			if (!body)
+				throw std::invalid_argument("Unsupported error status code: " + std::to_string(status_code));
+			body->content = content;
+			body->content_type = content_type;
+		}
+
+		// Serialize responses for all error status codes
+		void render(unsigned int retry_after)
+		{
+			m_pages.clear();
+			for (const auto& body : m_bodies)
+			{
+				ErrorPage page;
+				page.status_code = body.status_code;
+				page.head = std::string{ " " } + body.status + "\r\n"
+					"Server: WsgiBoost v." WSGI_BOOST_VERSION "\r\n";
+				if (body.status_code == 503)
+					page.head += "Retry-After: " + std::to_string(retry_after) + "\r\n";
+				if (!body.content.empty())
+					page.head += "Content-Type: " + body.content_type + "\r\n";
+				page.head += "Content-Length: " + std::to_string(body.content.length()) + "\r\n";
+				page.keep_alive = "Connection: keep-alive\r\n\r\n" + body.content;
+				page.close = "Connection: close\r\n\r\n" + body.content;
+				m_pages.push_back(page);
+			}
+		}
+
+		// Get the page of an error status code
+		const ErrorPage& get(int status_code) const
+		{
+			for (const auto& page : m_pages)
+			{
+				if (page.status_code == status_code)
+					return page;
+			}
+			throw std::invalid_argument("Unsupported error status code: " + std::to_string(status_code));
+		}
+	};
+}
@@ -0,0 +1,487 @@
+#pragma once
+/*
+Cache of static file metadata and contents
+
+Copyright (c) 2017 Roman Miroshnychenko <romanvm@yandex.ua>
+License: MIT, see License.txt
+*/
+
+#include "hash.h"
+
+#include <boost/filesystem.hpp>
+#include <boost/iostreams/device/array.hpp>
+#include <boost/iostreams/device/back_inserter.hpp>
+#include <boost/iostreams/filtering_stream.hpp>
+#include <boost/iostreams/filter/gzip.hpp>
+#include <boost/iostreams/copy.hpp>
+
+#include <chrono>
+#include <ctime>
+#include <deque>
+#include <fstream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+
+namespace wsgi_boost
+{
+	enum FileStatus { FILE_FOUND, FILE_NOT_FOUND, INVALID_CONTENT_DIR };
+
+	// Metadata of a static file
+	struct FileInfo
+	{
+		std::string path; // Canonical path
+		time_t last_modified;
+		size_t file_size;
+	};
+
+
+	// Find a static file inside a content directory, index.html is used for directories
+	//
+	// The call may block on disk I/O.
+	inline FileStatus lookup_file(const std::string& content_dir, const std::string& content_path, FileInfo& info)
+	{
+		const boost::filesystem::path content_dir_path{ content_dir };
+		boost::system::error_code ec;
+		if (!boost::filesystem::exists(content_dir_path, ec))
+			return INVALID_CONTENT_DIR;
+		boost::filesystem::path path = boost::filesystem::canonical(content_dir_path / content_path, ec);
+		if (ec)
+			return FILE_NOT_FOUND;
+		// Checking if path is inside content_dir
+		if (std::distance(content_dir_path.begin(), content_dir_path.end()) > std::distance(path.begin(), path.end()) ||
+			!std::equal(content_dir_path.begin(), content_dir_path.end(), path.begin()))
+			return FILE_NOT_FOUND;
+		if (boost::filesystem::is_directory(path, ec))
+			path /= "index.html";
+		if (!boost::filesystem::is_regular_file(path, ec))
+			return FILE_NOT_FOUND;
+		info.file_size = static_cast<size_t>(boost::filesystem::file_size(path, ec));
+		if (ec)
+			return FILE_NOT_FOUND;
+		info.last_modified = boost::filesystem::last_write_time(path, ec);
+		if (ec)
+			return FILE_NOT_FOUND;
+		info.path = path.string();
+		return FILE_FOUND;
+	}
+
+
+	// Get the key of a path in a content directory for LookupCache
+	//
+	// Leading slashes do not change the result of lookup_file(), so they are dropped,
+	// and a path gets the same key whether or not a static route consumes the slash.
+	inline std::string lookup_key(const std::string& content_dir, const std::string& content_path)
+	{
+		size_t start = content_path.find_first_not_of('/');
+		if (start == std::string::npos)
+			return content_dir + '\n';
+		return content_dir + '\n' + content_path.substr(start);
+	}
+
+
+	// Update the size and modification time of a found file
+	//
+	// Unlike lookup_file() the canonical path is not resolved again, so this takes only
+	// two stat calls. Returns false if the file is no longer a regular file.
+	inline bool check_file(FileInfo& info)
+	{
+		const boost::filesystem::path path{ info.path };
+		boost::system::error_code ec;
+		size_t file_size = static_cast<size_t>(boost::filesystem::file_size(path, ec));
+		if (ec)
+			return false;
+		time_t last_modified = boost::filesystem::last_write_time(path, ec);
+		if (ec)
+			return false;
+		info.file_size = file_size;
+		info.last_modified = last_modified;
+		return true;
+	}
+
+
+	// Contents of a whole file copied into memory
+	//
+	// Cached files are not memory-mapped, because reading a part of a mapping
+	// after the file has been truncated in place (e.g. by cp or an editor) raises SIGBUS.
+	class CachedFile
+	{
+	private:
+		std::vector<char> m_data;
+
+	public:
+		// Read a file of the expected size, the size is 0 if the file can not be read or has been changed
+		CachedFile(const std::string& path, size_t file_size) : m_data(file_size)
+		{
+			std::ifstream ifs{ path, std::ios::in | std::ios::binary };
+			if (!ifs || !ifs.read(&m_data[0], file_size) || ifs.peek() != std::ifstream::traits_type::eof())
+				m_data.clear();
+		}
+
+		CachedFile(const CachedFile&) = delete;
+		CachedFile& operator=(const CachedFile&) = delete;
+
+		const char* data() const { return m_data.data(); }
+
+		size_t size() const { return m_data.size(); }
+	};
+
+
+	// Metadata, contents and gzip-compressed variants of hot static files
+	// shared by all connections and threads
+	//
+	// Entries are kept per file version (modification time and size).
+	// Contents and compressed variants are refcounted with shared_ptr, so data evicted from the cache
+	// or replaced after a file change stay valid until all responses that use them are sent.
+	// The least recently used entries are evicted when the total size of contents
+	// and compressed variants exceeds the limit.
+	class FileCache
+	{
+	private:
+		struct Entry
+		{
+			time_t last_modified;
+			size_t file_size;
+			std::shared_ptr<const CachedFile> file;
+			std::shared_ptr<const std::string> gzip;
+			std::string etag;
+			std::list<std::string>::iterator lru_pos;
+		};
+
+		static const size_t max_entries = 65536;
+
+		std::unordered_map<std::string, Entry> m_entries;
+		std::list<std::string> m_lru; // Most recently used first
+		size_t m_size = 0;
+		size_t m_max_size = 0;
+		size_t m_max_file_size = 0;
+		mutable std::mutex m_mutex;
+
+		static size_t cost(const Entry& entry)
+		{
+			return (entry.file ? entry.file->size() : 0) + (entry.gzip ? entry.gzip->size() : 0);
+		}
+
+		// The following methods must be called with the lock held
+
+		// Find the entry of a file version and mark it as recently used
+		Entry* find_entry(const std::string& path, time_t last_modified, size_t file_size)
+		{
+			auto it = m_entries.find(path);
+			if (it == m_entries.end() || it->second.last_modified != last_modified || it->second.file_size != file_size)
+				return nullptr;
+			m_lru.splice(m_lru.begin(), m_lru, it->second.lru_pos);
+			return &it->second;
+		}
+
+		// Get the entry of a file version, an entry of another version is reset
+		Entry& update_entry(const std::string& path, time_t last_modified, size_t file_size)
+		{
+			auto it = m_entries.find(path);
+			if (it == m_entries.end())
+			{
+				m_lru.push_front(path);
+				it = m_entries.emplace(path, Entry{ last_modified, file_size, nullptr, nullptr, std::string(), m_lru.begin() }).first;
+			}
+			else
+			{
+				m_lru.splice(m_lru.begin(), m_lru, it->second.lru_pos);
+				if (it->second.last_modified != last_modified || it->second.file_size != file_size)
+				{
+					m_size -= cost(it->second);
+					it->second = Entry{ last_modified, file_size, nullptr, nullptr, std::string(), it->second.lru_pos };
+				}
+			}
+			return it->second;
+		}
+
+		// Evict least recently used entries except for the most recent one
+		void evict()
+		{
+			while (m_lru.size() > 1 && (m_size > m_max_size || m_entries.size() > max_entries))
+			{
+				auto it = m_entries.find(m_lru.back());
+				m_size -= cost(it->second);
+				m_entries.erase(it);
+				m_lru.pop_back();
+			}
+		}
+
+	public:
+		FileCache() {}
+
+		FileCache(const FileCache&) = delete;
+		FileCache& operator=(const FileCache&) = delete;
+
+		// Set the max. total size of file contents and compressed variants and the max. size
+		// of a single file in bytes and drop all entries. 0 max_size disables caching file contents.
+		void configure(size_t max_size, size_t max_file_size)
+		{
+			std::lock_guard<std::mutex> lock{ m_mutex };
+			m_entries.clear();
+			m_lru.clear();
+			m_size = 0;
+			m_max_size = max_size;
+			m_max_file_size = max_file_size < max_size ? max_file_size : max_size;
+		}
+
+		// Check if contents of a file with the given size can be cached
+		bool cacheable(size_t file_size)
+		{
+			std::lock_guard<std::mutex> lock{ m_mutex };
+			return file_size > 0 && file_size <= m_max_file_size;
+		}
+
+		// Find cached contents of a file with the given modification time and size
+		std::shared_ptr<const CachedFile> find(const std::string& path, time_t last_modified, size_t file_size)
+		{
+			std::lock_guard<std::mutex> lock{ m_mutex };
+			Entry* entry = find_entry(path, last_modified, file_size);
+			return entry ? entry->file : nullptr;
+		}
+
+		// Get cached contents of a file or read the file into memory,
+		// so the call may block on disk I/O
+		//
+		// Returns nullptr if the file is empty, too large or can not be read.
+		std::shared_ptr<const CachedFile> get(const std::string& path, time_t last_modified, size_t file_size)
+		{
+			if (!cacheable(file_size))
+				return nullptr;
+			std::shared_ptr<const CachedFile> cached = find(path, last_modified, file_size);
+			if (cached)
+				return cached;
+			// A file is read without holding the lock, so concurrent misses
+			// may read the same file, and the last copy is cached.
+			std::shared_ptr<const CachedFile> file = std::make_shared<const CachedFile>(path, file_size);
+			if (file->size() != file_size)
+				return nullptr; // The file is being changed or can not be read
+			std::lock_guard<std::mutex> lock{ m_mutex };
+			Entry& entry = update_entry(path, last_modified, file_size);
+			if (entry.file)
+				m_size -= entry.file->size();
+			entry.file = file;
+			m_size += file_size;
+			evict();
+			return file;
+		}
+
+		// Find a cached content ETag of a file version, returns an empty string if not found
+		std::string find_etag(const std::string& path, time_t last_modified, size_t file_size)
+		{
+			std::lock_guard<std::mutex> lock{ m_mutex };
+			Entry* entry = find_entry(path, last_modified, file_size);
+			return entry ? entry->etag : std::string();
+		}
+
+		// Get a strong ETag from the XXH64 hash of file contents
+		//
+		// A hash is computed once per file version, so the call may block on disk I/O.
+		// Returns an empty string if the file can not be read.
+		std::string get_etag(const std::string& path, time_t last_modified, size_t file_size)
+		{
+			std::string etag = find_etag(path, last_modified, file_size);
+			if (!etag.empty())
+				return etag;
+			XXHash64 hash;
+			std::shared_ptr<const CachedFile> cached_file = find(path, last_modified, file_size);
+			if (cached_file)
+			{
+				hash.update(cached_file->data(), cached_file->size());
+			}
+			else
+			{
+				std::ifstream ifs{ path, std::ios::in | std::ios::binary };
+				if (!ifs)
+					return std::string();
+				std::vector<char> buffer(131072);
+				size_t length = 0;
+				while (ifs.read(&buffer[0], buffer.size()).gcount() > 0)
+				{
+					hash.update(&buffer[0], static_cast<size_t>(ifs.gcount()));
+					length += static_cast<size_t>(ifs.gcount());
+				}
+				if (length != file_size)
+					return std::string(); // The file is being changed
+			}
+			etag = "\"" + hash.hex_digest() + "\"";
+			std::lock_guard<std::mutex> lock{ m_mutex };
+			update_entry(path, last_modified, file_size).etag = etag;
+			evict();
+			return etag;
+		}
+
+		// Find a cached gzip-compressed variant of a file version
+		std::shared_ptr<const std::string> find_gzip(const std::string& path, time_t last_modified, size_t file_size)
+		{
+			std::lock_guard<std::mutex> lock{ m_mutex };
+			Entry* entry = find_entry(path, last_modified, file_size);
+			return entry ? entry->gzip : nullptr;
+		}
+
+		// Get a gzip-compressed variant of a file
+		//
+		// A file is compressed once per version if it is small enough to be cached,
+		// so the call may block on disk I/O. Returns nullptr if the file can not be read.
+		std::shared_ptr<const std::string> get_gzip(const std::string& path, time_t last_modified, size_t file_size)
+		{
+			std::shared_ptr<const std::string> cached = find_gzip(path, last_modified, file_size);
+			if (cached)
+				return cached;
+			boost::iostreams::filtering_istream gzstream;
+			gzstream.push(boost::iostreams::gzip_compressor());
+			std::shared_ptr<const CachedFile> cached_file = find(path, last_modified, file_size);
+			std::ifstream ifs;
+			if (cached_file)
+			{
+				gzstream.push(boost::iostreams::array_source{ cached_file->data(), cached_file->size() });
+			}
+			else
+			{
+				ifs.open(path, std::ios::in | std::ios::binary);
+				if (!ifs)
+					return nullptr;
+				gzstream.push(ifs);
+			}
+			std::shared_ptr<std::string> compressed = std::make_shared<std::string>();
+			boost::iostreams::copy(gzstream, boost::iostreams::back_inserter(*compressed));
+			if (!cacheable(file_size))
+				return compressed;
+			std::lock_guard<std::mutex> lock{ m_mutex };
+			Entry& entry = update_entry(path, last_modified, file_size);
+			if (entry.gzip)
+				m_size -= entry.gzip->size();
+			entry.gzip = compressed;
+			m_size += compressed->size();
+			evict();
+			return compressed;
+		}
+
+		// Get the total size of cached contents and compressed variants in bytes
+		size_t size() const
+		{
+			std::lock_guard<std::mutex> lock{ m_mutex };
+			return m_size;
+		}
+	};
+
+
+	// Results of static file lookups, so repeated requests for the same paths
+	// do not resolve them in the filesystem again
+	//
+	// A found file is kept until the cache is full, but its size and modification time
+	// must be checked with check_file() when they are older than the found TTL.
+	// Missed paths expire after their TTL, so files created later are found after that time.
+	// When the cache is full the oldest entries are dropped first.
+	class LookupCache
+	{
+	private:
+		typedef std::chrono::steady_clock clock;
+
+		struct Entry
+		{
+			FileStatus status;
+			FileInfo info;
+			clock::time_point checked;
+			unsigned long long version;
+		};
+
+		static const size_t max_entries = 16384;
+
+		std::unordered_map<std::string, Entry> m_entries;
+		std::deque<std::pair<std::string, unsigned long long>> m_queue; // Oldest first
+		unsigned long long m_version = 0;
+		std::chrono::milliseconds m_found_ttl{ 0 };
+		std::chrono::milliseconds m_not_found_ttl{ 0 };
+		std::mutex m_mutex;
+
+		// Drop expired missed paths and the oldest entries above the limit, must be called with the lock held
+		void expire(clock::time_point now)
+		{
+			while (!m_queue.empty())
+			{
+				auto it = m_entries.find(m_queue.front().first);
+				// A path may have been added again later
+				bool current = it != m_entries.end() && it->second.version == m_queue.front().second;
+				if (current && m_queue.size() <= max_entries &&
+					(it->second.status == FILE_FOUND || it->second.checked + m_not_found_ttl > now))
+					break;
+				if (current)
+					m_entries.erase(it);
+				m_queue.pop_front();
+			}
+		}
+
+	public:
+		LookupCache() {}
+
+		LookupCache(const LookupCache&) = delete;
+		LookupCache& operator=(const LookupCache&) = delete;
+
+		// Set how long found files are not checked for changes and how long missed paths are kept
+		// in milliseconds and drop all entries, 0 TTL of missed paths disables caching them
+		void configure(unsigned int found_ttl, unsigned int not_found_ttl)
+		{
+			std::lock_guard<std::mutex> lock{ m_mutex };
+			m_entries.clear();
+			m_queue.clear();
+			m_found_ttl = std::chrono::milliseconds{ found_ttl };
+			m_not_found_ttl = std::chrono::milliseconds{ not_found_ttl };
+		}
+
+		// Find the lookup result of a path
+		//
+		// fresh is false if a found file must be checked for changes.
+		bool find(const std::string& path, FileStatus& status, FileInfo& info, bool& fresh)
+		{
+			std::lock_guard<std::mutex> lock{ m_mutex };
+			if (m_entries.empty())
+				return false;
+			auto it = m_entries.find(path);
+			if (it == m_entries.end())
+				return false;
+			clock::time_point now = clock::now();
+			if (it->second.status == FILE_FOUND)
+			{
+				fresh = it->second.checked + m_found_ttl > now;
+			}
+			else
+			{
+				if (it->second.checked + m_not_found_ttl <= now)
+					return false;
+				fresh = true;
+			}
+			status = it->second.status;
+			info = it->second.info;
+			return true;
+		}
+
+		// Remember a lookup result of a path, an invalid content directory is not cached
+		void add(const std::string& path, FileStatus status, const FileInfo& info)
+		{
+			std::lock_guard<std::mutex> lock{ m_mutex };
+			if (status == INVALID_CONTENT_DIR || (status == FILE_NOT_FOUND && m_not_found_ttl.count() == 0))
+				return;
+			clock::time_point now = clock::now();
+			m_entries[path] = Entry{ status, info, now, ++m_version };
+			m_queue.emplace_back(path, m_version);
+			expire(now);
+		}
+
+		// Store the checked size and modification time of a found file
+		void update(const std::string& path, const FileInfo& info)
+		{
+			std::lock_guard<std::mutex> lock{ m_mutex };
+			auto it = m_entries.find(path);
+			if (it == m_entries.end() || it->second.status != FILE_FOUND)
+				return;
+			it->second.info.file_size = info.file_size;
+			it->second.info.last_modified = info.last_modified;
+			it->second.checked = clock::now();
+		}
+	};
+}
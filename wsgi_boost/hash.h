@@ -0,0 +1,162 @@
+#pragma once
+/*
+Fast non-cryptographic hash
+
+Copyright (c) 2017 Roman Miroshnychenko <romanvm@yandex.ua>
+License: MIT, see License.txt
+*/
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+
+namespace wsgi_boost
+{
+	// Streaming XXH64 hash (https://github.com/Cyan4973/xxHash)
+	//
+	// Input words are read in the host byte order, so hashes match the reference
+	// implementation on little-endian hosts.
+	class XXHash64
+	{
+	private:
+		static const uint64_t prime1 = 11400714785074694791ULL;
+		static const uint64_t prime2 = 14029467366897019727ULL;
+		static const uint64_t prime3 = 1609587929392839161ULL;
+		static const uint64_t prime4 = 9650029242287828579ULL;
+		static const uint64_t prime5 = 2870177450012600261ULL;
+
+		uint64_t m_acc[4];
+		uint64_t m_seed;
+		uint64_t m_total_length = 0;
+		unsigned char m_buffer[32];
+		size_t m_buffer_size = 0;
+
+		static uint64_t rotl(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+
+		static uint64_t read64(const unsigned char* p)
+		{
+			uint64_t value;
+			std::memcpy(&value, p, sizeof(value));
+			return value;
+		}
+
+		static uint32_t read32(const unsigned char* p)
+		{
+			uint32_t value;
+			std::memcpy(&value, p, sizeof(value));
+			return value;
+		}
+
+		static uint64_t round(uint64_t acc, uint64_t input)
+		{
+			acc += input * prime2;
+			acc = rotl(acc, 31);
+			return acc * prime1;
+		}
+
+		static uint64_t merge_round(uint64_t acc, uint64_t value)
+		{
+			acc ^= round(0, value);
+			return acc * prime1 + prime4;
+		}
+
+		void process_stripe(const unsigned char* p)
+		{
+			m_acc[0] = round(m_acc[0], read64(p));
+			m_acc[1] = round(m_acc[1], read64(p + 8));
+			m_acc[2] = round(m_acc[2], read64(p + 16));
+			m_acc[3] = round(m_acc[3], read64(p + 24));
+		}
+
+	public:
+		explicit XXHash64(uint64_t seed = 0) : m_seed{ seed }
+		{
+			m_acc[0] = seed + prime1 + prime2;
+			m_acc[1] = seed + prime2;
+			m_acc[2] = seed;
+			m_acc[3] = seed - prime1;
+		}
+
+		// Add data to the hash
+		void update(const char* data, size_t length)
+		{
+			const unsigned char* p = reinterpret_cast<const unsigned char*>(data);
+			const unsigned char* end = p + length;
+			m_total_length += length;
+			if (m_buffer_size + length < sizeof(m_buffer))
+			{
+				std::memcpy(m_buffer + m_buffer_size, p, length);
+				m_buffer_size += length;
+				return;
+			}
+			if (m_buffer_size > 0)
+			{
+				size_t size = sizeof(m_buffer) - m_buffer_size;
+				std::memcpy(m_buffer + m_buffer_size, p, size);
+				process_stripe(m_buffer);
+				p += size;
+				m_buffer_size = 0;
+			}
+			for (; p + sizeof(m_buffer) <= end; p += sizeof(m_buffer))
+				process_stripe(p);
+			m_buffer_size = end - p;
+			std::memcpy(m_buffer, p, m_buffer_size);
+		}
+
+		// Get the hash of all data added so far
+		uint64_t digest() const
+		{
+			uint64_t hash;
+			if (m_total_length >= sizeof(m_buffer))
+			{
+				hash = rotl(m_acc[0], 1) + rotl(m_acc[1], 7) + rotl(m_acc[2], 12) + rotl(m_acc[3], 18);
+				for (size_t i = 0; i < 4; ++i)
+					hash = merge_round(hash, m_acc[i]);
+			}
+			else
+			{
+				hash = m_seed + prime5;
+			}
+			hash += m_total_length;
+			const unsigned char* p = m_buffer;
+			const unsigned char* end = m_buffer + m_buffer_size;
+			for (; p + 8 <= end; p += 8)
+			{
+				hash ^= round(0, read64(p));
+				hash = rotl(hash, 27) * prime1 + prime4;
+			}
+			if (p + 4 <= end)
+			{
+				hash ^= static_cast<uint64_t>(read32(p)) * prime1;
+				hash = rotl(hash, 23) * prime2 + prime3;
+				p += 4;
+			}
+			for (; p < end; ++p)
+			{
+				hash ^= *p * prime5;
+				hash = rotl(hash, 11) * prime1;
+			}
+			hash ^= hash >> 33;
+			hash *= prime2;
+			hash ^= hash >> 29;
+			hash *= prime3;
+			hash ^= hash >> 32;
+			return hash;
+		}
+
+		// Get the hash as 16 hexadecimal digits
+		std::string hex_digest() const
+		{
+			static const char digits[] = "0123456789abcdef";
+			uint64_t hash = digest();
+			std::string result(16, '0');
+			for (size_t i = 16; i > 0; --i)
+			{
+				result[i - 1] = digits[hash & 0xf];
+				hash >>= 4;
+			}
+			return result;
+		}
+	};
+}
@@ -7,15 +7,53 @@ License: MIT, see License.txt
 */
 
 #include <boost/asio.hpp>
+#include <boost/version.hpp>
 
 #include <thread>
 #include <memory>
 #include <vector>
 
+// The io_uring backend is enabled by defining BOOST_ASIO_HAS_IO_URING and BOOST_ASIO_DISABLE_EPOLL
+#if defined(BOOST_ASIO_HAS_IO_URING) && BOOST_VERSION < 107800
+#error "io_uring backend requires Boost 1.78 or above!"
+#endif
+
 namespace wsgi_boost
 {
 	typedef std::shared_ptr<boost::asio::io_service> io_service_ptr;
 
+	// Get the io_service of an I/O object
+	//
+	// get_io_service() methods have been replaced with executors since Boost 1.66
+	// and removed in Boost 1.70.
+	template <class IoObject>
+	inline boost::asio::io_service& get_io_service(IoObject& object)
+	{
+#if BOOST_VERSION >= 106600
+		return static_cast<boost::asio::io_service&>(object.get_executor().context());
+#else
+		return object.get_io_service();
+#endif
+	}
+
+	// Get the name of the I/O backend that runs io_services
+	inline const char* io_backend()
+	{
+#if defined(BOOST_ASIO_HAS_IO_URING_AS_DEFAULT)
+		return "io_uring";
+#elif defined(BOOST_ASIO_HAS_IOCP)
+		return "iocp";
+#elif defined(BOOST_ASIO_HAS_EPOLL)
+		return "epoll";
+#elif defined(BOOST_ASIO_HAS_KQUEUE)
+		return "kqueue";
+#elif defined(BOOST_ASIO_HAS_DEV_POLL)
+		return "/dev/poll";
+#else
+		return "select";
+#endif
+	}
+
 	class IoServicePool
 	{
 	private:
@@ -7,48 +7,147 @@ License: MIT, see License.txt
 */
 
 #include "connection.h"
+#include "tracing.h"
 
 #include <boost/asio.hpp>
-#include <boost/functional/hash.hpp>
 #include <boost/algorithm/string.hpp>
 #include <boost/algorithm/string/predicate.hpp>
-#include <boost/regex.hpp>
+#include <boost/container/small_vector.hpp>
+#include <boost/utility/string_ref.hpp>
 
-#include <unordered_map>
 #include <cctype>
 #include <string>
+#include <vector>
 
 
 #define PARSE_OK 0
 #define CONN_ERROR 1
 #define BAD_REQUEST 2
 #define LENGTH_REQUIRED 3
+#define HEADER_TOO_LARGE 4
+#define PAYLOAD_TOO_LARGE 5
 
 
 namespace wsgi_boost
 {
 	typedef int parse_result;
 
-	// 2 structs below are used for unordered_map with case-insensitive string keys
-
-	struct iequal_to
+	// Request header fields stored as slices of the raw header
+	//
+	// Typical requests have a dozen of fields, so a flat list with precomputed
+	// case-insensitive name hashes is searched faster than a hash table
+	// and filled without allocating a node and strings per field.
+	class HeaderList
 	{
-		bool operator()(const std::string &key1, const std::string &key2) const
+	private:
+		struct Field
+		{
+			size_t hash;
+			size_t name_pos;
+			size_t name_len;
+			size_t value_pos;
+			size_t value_len;
+		};
+
+		std::string m_data;
+		boost::container::small_vector<Field, 16> m_fields;
+
+		static char to_lower(char ch)
 		{
-			return boost::algorithm::iequals(key1, key2);
+			return (ch >= 'A' && ch <= 'Z') ? ch + ('a' - 'A') : ch;
+		}
+
+		// Case-insensitive FNV-1a hash
+		static size_t hash(const char* str, size_t length)
+		{
+			size_t h = 2166136261U;
+			for (size_t i = 0; i < length; ++i)
+			{
+				h ^= static_cast<unsigned char>(to_lower(str[i]));
+				h *= 16777619U;
+			}
+			return h;
+		}
+
+		// Find a field by name and its hash, names are compared only if hashes are equal
+		const Field* find(const char* name, size_t length, size_t h) const
+		{
+			for (const auto& field : m_fields)
+			{
+				if (field.hash != h || field.name_len != length)
+					continue;
+				size_t i = 0;
+				while (i < length && to_lower(m_data[field.name_pos + i]) == to_lower(name[i]))
+					++i;
+				if (i == length)
+					return &field;
+			}
+			return nullptr;
 		}
-	};
 
+		const Field* find(const std::string& name) const
+		{
+			return find(name.data(), name.length(), hash(name.data(), name.length()));
+		}
 
-	struct ihash
-	{
-		size_t operator()(const std::string &key) const
+	public:
+		// Set the raw header and drop all fields
+		void assign(std::string data)
 		{
-			std::size_t seed = 0;
-			for (auto &c : key)
-				boost::hash_combine(seed, std::tolower(c));
-			return seed;
+			m_data = std::move(data);
+			m_fields.clear();
 		}
+
+		const std::string& data() const { return m_data; }
+
+		// Add a field from the raw header, values of repeated fields are joined with commas
+		void add(size_t name_pos, size_t name_len, size_t value_pos, size_t value_len)
+		{
+			size_t h = hash(m_data.data() + name_pos, name_len);
+			const Field* existing = find(m_data.data() + name_pos, name_len, h);
+			if (!existing)
+			{
+				m_fields.push_back(Field{ h, name_pos, name_len, value_pos, value_len });
+				return;
+			}
+			// Joined values are appended after the raw header
+			Field& field = m_fields[existing - &m_fields[0]];
+			std::string joined = m_data.substr(field.value_pos, field.value_len) + ", " + m_data.substr(value_pos, value_len);
+			field.value_pos = m_data.length();
+			field.value_len = joined.length();
+			m_data += joined;
+		}
+
+		size_t size() const { return m_fields.size(); }
+
+		boost::string_ref name(size_t i) const
+		{
+			return boost::string_ref{ m_data.data() + m_fields[i].name_pos, m_fields[i].name_len };
+		}
+
+		boost::string_ref value(size_t i) const
+		{
+			return boost::string_ref{ m_data.data() + m_fields[i].value_pos, m_fields[i].value_len };
+		}
+
+		// Get a field value or an empty string if the field is missing
+		boost::string_ref get(const std::string& name) const
+		{
+			const Field* field = find(name);
+			if (!field)
+				return boost::string_ref{};
+			return boost::string_ref{ m_data.data() + field->value_pos, field->value_len };
+		}
+
+		bool contains(const std::string& name) const { return find(name) != nullptr; }
+	};
+
+	// Request size limits, 0 - no limit
+	struct RequestLimits
+	{
+		size_t max_header_size;
+		unsigned int max_header_count;
+		unsigned long long max_body_size;
 	};
 
 	// HTTP request
@@ -62,9 +161,13 @@ namespace wsgi_boost
 		std::string method;
 		std::string path;
 		std::string http_version;
-		std::unordered_map<std::string, std::string, ihash, iequal_to> headers;
-		boost::regex path_regex;
+		HeaderList headers;
 		std::string content_dir;
+		// The request path with the static route match stripped
+		std::string content_path;
+		// The path prefix of a mounted WSGI app
+		std::string script_name;
+		RequestTrace trace;
 
 		Request(const Request&) = delete;
 		Request& operator=(const Request&) = delete;
@@ -72,16 +175,18 @@ namespace wsgi_boost
 		explicit Request(conn_t& connection) : m_connection{ connection } {}
 
 		// Parse HTTP request headers
-		parse_result parse_header()
+		//
+		// Requests that exceed the limits are rejected before their content is read.
+		parse_result parse_header(const RequestLimits& limits = RequestLimits{ 0, 0, 0 })
 		{
 			std::string header;
-			boost::system::error_code ec = m_connection.read_header(header);
+			boost::system::error_code ec = m_connection.read_header(header, limits.max_header_size);
+			if (ec == boost::asio::error::message_size)
+				return HEADER_TOO_LARGE;
 			if (ec)
 				return CONN_ERROR;
-			std::istringstream iss{ header };
-			std::string line;
-			std::getline(iss, line);
-			line.pop_back();
+			size_t line_end = header.find("\r\n");
+			std::string line = header.substr(0, line_end);
 			std::vector<std::string> parts;
 			boost::algorithm::split(parts, line,
 				boost::algorithm::is_space(),
@@ -91,28 +196,44 @@ namespace wsgi_boost
 			method = parts[0];
 			path = parts[1];
 			http_version = parts[2];
-			while (true)
+			headers.assign(std::move(header));
+			const std::string& data = headers.data();
+			unsigned int header_count = 0;
+			size_t pos = line_end + 2;
+			size_t end;
+			// The header ends with an empty line
+			while ((end = data.find("\r\n", pos)) != std::string::npos && end > pos)
 			{
-				std::getline(iss, line);
-				if (!iss.good())
-					break;
-				line.pop_back();
-				size_t pos = line.find(':');
-				if (pos != std::string::npos)
+				if (limits.max_header_count > 0 && ++header_count > limits.max_header_count)
+					return HEADER_TOO_LARGE;
+				size_t colon = data.find(':', pos);
+				if (colon < end)
 				{
-					std::string name = boost::algorithm::trim_copy(line.substr(0, pos));
-					std::string value = boost::algorithm::trim_copy(line.substr(pos + 1));
-					if (headers.find(name) == headers.end())
-						headers.emplace(name, value);
-					else
-						headers[name] += ", " + value;
+					size_t name_pos = pos;
+					size_t name_end = colon;
+					size_t value_pos = colon + 1;
+					size_t value_end = end;
+					while (name_pos < name_end && (data[name_pos] == ' ' || data[name_pos] == '\t'))
+						++name_pos;
+					while (name_end > name_pos && (data[name_end - 1] == ' ' || data[name_end - 1] == '\t'))
+						--name_end;
+					while (value_pos < value_end && (data[value_pos] == ' ' || data[value_pos] == '\t'))
+						++value_pos;
+					while (value_end > value_pos && (data[value_end - 1] == ' ' || data[value_end - 1] == '\t'))
+						--value_end;
+					headers.add(name_pos, name_end - name_pos, value_pos, value_end - value_pos);
 				}
+				pos = end + 2;
 			}
 			if (method == "POST" || method == "PUT" || method == "PATCH")
 			{
 				try
 				{
 					long long cl = stoll(get_header("Content-Length"));
+					if (cl < 0)
+						return BAD_REQUEST;
+					if (limits.max_body_size > 0 && static_cast<unsigned long long>(cl) > limits.max_body_size)
+						return PAYLOAD_TOO_LARGE;
 					m_connection.post_content_length(cl);
 				}
 				catch (const std::logic_error&)
@@ -130,15 +251,13 @@ namespace wsgi_boost
 		// Check if a header contains a specific value
 		bool check_header(const std::string& header, const std::string& value) const
 		{
-			auto it = headers.find(header);
-			return (it != headers.end()) && boost::algorithm::icontains(it->second, value);
+			return boost::algorithm::icontains(headers.get(header), value);
 		}
 
 		// Get header value or "" if the header is missing
 		std::string get_header(const std::string& header) const
 		{
-			auto it = headers.find(header);
-			return it != headers.end() ? it->second : std::string();
+			return headers.get(header).to_string();
 		}
 
 		// Check if the connection is persistent (keep-alive)
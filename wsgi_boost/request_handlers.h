@@ -8,11 +8,9 @@ License: MIT, see License.txt
 
 #include "request.h"
 #include "response.h"
+#include "file_cache.h"
 
 #include <boost/filesystem.hpp>
-#include <boost/iostreams/filtering_stream.hpp>
-#include <boost/iostreams/filter/gzip.hpp>
-#include <boost/iostreams/copy.hpp>
 
 #include <unordered_map>
 #include <string>
@@ -20,6 +18,9 @@ License: MIT, see License.txt
 #include <iostream>
 #include <sstream>
 #include <utility>
+#include <random>
+#include <vector>
+#include <algorithm>
 
 
 namespace wsgi_boost
@@ -52,132 +53,275 @@ namespace wsgi_boost
 	private:
 		std::string& m_cache_control;
 		bool m_use_gzip;
+		bool m_use_sendfile;
+		bool m_content_etags;
+		FileCache& m_file_cache;
+		LookupCache& m_lookup_cache;
+		BlockingPool& m_blocking_pool;
 
-		void open_file(const boost::filesystem::path& content_dir_path)
+		// Send a found file, recent is true if the file has been looked up by a previous request
+		void open_file(const FileInfo& info, bool recent)
 		{
-			boost::filesystem::path path = content_dir_path;
-			path /= boost::regex_replace(m_request.path, m_request.path_regex, "");
-			boost::system::error_code ec;
-			path = boost::filesystem::canonical(path, ec);
-			if (!ec)
+			out_headers_t out_headers;
+			out_headers.emplace_back("Cache-Control", m_cache_control);
+			time_t last_modified = info.last_modified;
+			out_headers.emplace_back("Last-Modified", time_to_header(last_modified));
+			const std::string& file_path = info.path;
+			size_t file_size = info.file_size;
+			std::string etag;
+			if (m_content_etags)
 			{
-				// Checking if path is inside content_dir
-				if (std::distance(content_dir_path.begin(), content_dir_path.end()) <= std::distance(path.begin(), path.end()) &&
-					std::equal(content_dir_path.begin(), content_dir_path.end(), path.begin()))
+				etag = m_file_cache.find_etag(file_path, last_modified, file_size);
+				if (etag.empty())
 				{
-					if (boost::filesystem::is_directory(path))
-						path /= "index.html";
-					if (boost::filesystem::exists(path) && boost::filesystem::is_regular_file(path))
+					run_blocking([this, &etag, &file_path, last_modified, file_size]()
 					{
-						std::ifstream ifs;
-						ifs.open(path.string(), std::ifstream::in | std::ios::binary);
-						if (ifs)
-						{
-							out_headers_t out_headers;
-							out_headers.emplace_back("Cache-Control", m_cache_control);
-							time_t last_modified = boost::filesystem::last_write_time(path);
-							out_headers.emplace_back("Last-Modified", time_to_header(last_modified));
-							// Use hex representation of the last modified POSIX timestamp as ETag
-							std::string etag = "\"" + hex(static_cast<size_t>(last_modified)) + "\"";
-							out_headers.emplace_back("ETag", etag);
-							std::string ims = m_request.get_header("If-Modified-Since");
-							if (m_request.get_header("If-None-Match") == etag || (!ims.empty() && header_to_time(ims) >= last_modified))
-							{
-								out_headers.emplace_back("Content-Length", "0");
-								m_response.send_header("304 Not Modified", out_headers);
-								return;
-							}
-							std::string ext = path.extension().string();
-							out_headers.emplace_back("Content-Type", get_mime(ext));
-							if (m_use_gzip && m_request.check_header("Accept-Encoding", "gzip") && is_compressable(ext))
-							{
-								boost::iostreams::filtering_istream gzstream;
-								gzstream.push(boost::iostreams::gzip_compressor());
-								gzstream.push(ifs);
-								std::stringstream compressed;
-								boost::iostreams::copy(gzstream, compressed);
-								out_headers.emplace_back("Content-Encoding", "gzip");
-								send_file(compressed, out_headers);
-							}
-							else
-							{
-								out_headers.emplace_back("Accept-Ranges", "bytes");
-								send_file(ifs, out_headers);
-							}
-							return;
-						}
-					}
+						etag = m_file_cache.get_etag(file_path, last_modified, file_size);
+					});
 				}
 			}
-			m_response.send_html("404 Not Found",
-				"Error 404", "Not Found",
-				"The requested path <code>" + m_request.path + "</code> was not found on this server.");
-		}
-
-		void send_file(std::istream& content_stream, out_headers_t& headers)
-		{
-			content_stream.seekg(0, std::ios::end);
-			size_t length = content_stream.tellg();
-			size_t start_pos = 0;
-			size_t end_pos = length - 1;
-			std::string requested_range = m_request.get_header("Range");
-			std::pair<std::string, std::string> range;
-			boost::system::error_code ec;
-			if (!requested_range.empty() && ((range = parse_range(requested_range)) != std::pair<std::string, std::string>()))
+			// Use hex representation of the last modified POSIX timestamp as ETag by default
+			if (etag.empty())
+				etag = "\"" + hex(static_cast<size_t>(last_modified)) + "\"";
+			std::string ext = boost::filesystem::path{ file_path }.extension().string();
+			bool compressable = m_use_gzip && is_compressable(ext);
+			bool use_gzip = compressable && m_request.check_header("Accept-Encoding", "gzip");
+			// The compressed variant is a different representation, so it has its own ETag
+			if (use_gzip)
+				etag.insert(etag.length() - 1, "-gz");
+			out_headers.emplace_back("ETag", etag);
+			if (compressable)
+				out_headers.emplace_back("Vary", "Accept-Encoding");
+			// If-Modified-Since is ignored if If-None-Match is present
+			std::string inm = m_request.get_header("If-None-Match");
+			std::string ims = m_request.get_header("If-Modified-Since");
+			if ((!inm.empty() && etag_matches(inm, etag)) ||
+				(inm.empty() && !ims.empty() && header_to_time(ims) >= last_modified))
 			{
-				if (!range.first.empty())
-					start_pos = std::stoull(range.first);
-				else
-					range.first = std::to_string(start_pos);
-				if (!range.second.empty())
-					end_pos = std::stoull(range.second);
-				else
-					range.second = std::to_string(end_pos);
-				if (start_pos > end_pos || start_pos >= length || end_pos >= length)
+				out_headers.emplace_back("Content-Length", "0");
+				m_response.send_header("304 Not Modified", out_headers);
+				return;
+			}
+			std::string content_type = get_mime(ext);
+			if (use_gzip)
+			{
+				// Compressed variants are cached, ranges of compressed content are not supported
+				std::shared_ptr<const std::string> compressed = m_file_cache.find_gzip(file_path, last_modified, file_size);
+				if (!compressed)
 				{
-					m_response.send_mesage("416 Range Not Satisfiable", "Invalid bytes range!");
-					return;
+					run_blocking([this, &compressed, &file_path, last_modified, file_size]()
+					{
+						compressed = m_file_cache.get_gzip(file_path, last_modified, file_size);
+					});
 				}
-				else
+				if (!compressed)
+					return send_not_found();
+				out_headers.emplace_back("Content-Encoding", "gzip");
+				send_content(compressed->length(), out_headers, content_type, false,
+					[this, &compressed](size_t offset, size_t length)
 				{
-					headers.emplace_back("Content-Length", std::to_string(end_pos - start_pos));
-					headers.emplace_back("Content-Range", "bytes " + range.first + "-" + range.second + "/" + std::to_string(length));
-					ec = m_response.send_header("206 Partial Content", headers);
-					if (ec)
-						return;
+					return m_response.send_buffer(compressed->data() + offset, length);
+				});
+				return;
+			}
+			// Zero-copy sendfile() is preferred to cached contents when it is available
+			std::shared_ptr<const CachedFile> cached;
+			if (!(m_use_sendfile && resp_t::sendfile_supported()))
+			{
+				cached = m_file_cache.find(file_path, last_modified, file_size);
+				if (!cached && m_file_cache.cacheable(file_size))
+				{
+					run_blocking([this, &cached, &file_path, last_modified, file_size]()
+					{
+						cached = m_file_cache.get(file_path, last_modified, file_size);
+					});
 				}
 			}
-			else
+			out_headers.emplace_back("Accept-Ranges", "bytes");
+			bool use_ranges = if_range_matches(etag, last_modified);
+			if (cached)
 			{
-				headers.emplace_back("Content-Length", std::to_string(length));
-				ec = m_response.send_header("200 OK", headers);
-				if (ec)
-					return;
+				send_content(file_size, out_headers, content_type, use_ranges,
+					[this, &cached](size_t offset, size_t length)
+				{
+					return m_response.send_buffer(cached->data() + offset, length);
+				});
+				return;
 			}
-			if (m_request.method == "GET")
+#ifdef __linux__
+			if (m_use_sendfile && resp_t::sendfile_supported())
 			{
-				if (start_pos > 0)
-					content_stream.seekg(start_pos);
+				// Small files that have been served recently are most likely in the page cache,
+				// so they are sent without a round trip to the blocking I/O pool
+				bool in_page_cache = recent && m_file_cache.cacheable(file_size);
+				std::unique_ptr<FileDescriptor> fd;
+				if (in_page_cache)
+					fd.reset(new FileDescriptor{ file_path });
 				else
-					content_stream.seekg(0, std::ios::beg);
+					run_blocking([&fd, &file_path]() { fd.reset(new FileDescriptor{ file_path }); });
+				if (fd->get() < 0)
+					return send_not_found();
+				send_content(file_size, out_headers, content_type, use_ranges,
+					[this, &fd, in_page_cache](size_t offset, size_t length) -> boost::system::error_code
+				{
+					// sendfile() blocks on disk reads, so each chunk is read into the page cache
+					// on the blocking I/O pool first
+					const size_t chunk_size = 1048576;
+					while (length > 0)
+					{
+						size_t size = std::min(length, chunk_size);
+						if (!in_page_cache)
+							run_blocking([&fd, offset, size]() { ::readahead(fd->get(), offset, size); });
+						boost::system::error_code ec = m_response.send_file(fd->get(), offset, size);
+						if (ec)
+							return ec;
+						offset += size;
+						length -= size;
+					}
+					return boost::system::error_code();
+				});
+				return;
+			}
+#endif
+			std::ifstream ifs;
+			run_blocking([&ifs, &file_path]() { ifs.open(file_path, std::ifstream::in | std::ios::binary); });
+			if (!ifs)
+				return send_not_found();
+			std::vector<char> buffer;
+			send_content(file_size, out_headers, content_type, use_ranges,
+				[this, &ifs, &buffer](size_t offset, size_t length) -> boost::system::error_code
+			{
 				const size_t buffer_size = 131072;
-				std::vector<char> buffer(buffer_size);
+				buffer.resize(std::min(length, buffer_size));
+				ifs.seekg(offset);
 				size_t read_length;
-				size_t bytes_left = end_pos - start_pos + 1;
-				while (bytes_left > 0 &&
-					((read_length = content_stream.read(&buffer[0], std::min(bytes_left, buffer_size)).gcount()) > 0))
+				while (length > 0)
 				{
-					ec = m_response.send_data(std::string{ &buffer[0], read_length });
+					run_blocking([&ifs, &buffer, &read_length, length]()
+					{
+						read_length = ifs.read(&buffer[0], std::min(length, buffer.size())).gcount();
+					});
+					if (read_length == 0)
+						break;
+					boost::system::error_code ec = m_response.send_data(&buffer[0], read_length);
 					if (ec)
-						return;
-					bytes_left -= read_length;
+						return ec;
+					length -= read_length;
 				}
+				if (length > 0)
+					return boost::asio::error::eof; // The file has been truncated
+				return boost::system::error_code();
+			});
+			return;
+		}
+
+		// Run a blocking function on the blocking I/O pool while the coroutine yields
+		void run_blocking(const std::function<void()>& func)
+		{
+			m_request.connection().run_blocking(m_blocking_pool, func);
+		}
+
+		void send_not_found()
+		{
+			m_response.send_error(404);
+		}
+
+		// Check if an If-Range precondition allows to send ranges of the current file version
+		bool if_range_matches(const std::string& etag, time_t last_modified)
+		{
+			std::string if_range = m_request.get_header("If-Range");
+			if (if_range.empty())
+				return true;
+			if (if_range[0] == '"')
+				return if_range == etag;
+			if (if_range.compare(0, 2, "W/") == 0)
+				return false; // Weak validators never match
+			return header_to_time(if_range) == last_modified;
+		}
+
+		// Send the whole content or requested ranges of it
+		//
+		// send_part(offset, length) sends a part of the content and returns an error code.
+		// Parts of a multipart/byteranges response are written after the buffered part headers.
+		template <class PartSender>
+		void send_content(size_t length, out_headers_t& headers, const std::string& content_type, bool use_ranges, PartSender send_part)
+		{
+			std::vector<ByteRange> ranges;
+			std::string requested_range;
+			if (use_ranges)
+				requested_range = m_request.get_header("Range");
+			bool send_body = m_request.method == "GET";
+			boost::system::error_code ec;
+			if (!requested_range.empty() && parse_range(requested_range, length, ranges))
+			{
+				if (ranges.empty())
+				{
+					m_response.send_error(416, "Content-Range: bytes */" + std::to_string(length) + "\r\n");
+					return;
+				}
+				if (ranges.size() == 1)
+				{
+					const ByteRange& range = ranges[0];
+					headers.emplace_back("Content-Type", content_type);
+					headers.emplace_back("Content-Length", std::to_string(range.last - range.first + 1));
+					headers.emplace_back("Content-Range", "bytes " + std::to_string(range.first) + "-" +
+						std::to_string(range.last) + "/" + std::to_string(length));
+					ec = m_response.send_header("206 Partial Content", headers, false);
+					if (!ec && send_body)
+						ec = send_part(range.first, range.last - range.first + 1);
+				}
+				else
+				{
+					std::string boundary = multipart_boundary();
+					std::vector<std::string> part_headers;
+					part_headers.reserve(ranges.size());
+					size_t content_length = 0;
+					for (const auto& range : ranges)
+					{
+						part_headers.push_back("\r\n--" + boundary + "\r\nContent-Type: " + content_type +
+							"\r\nContent-Range: bytes " + std::to_string(range.first) + "-" + std::to_string(range.last) +
+							"/" + std::to_string(length) + "\r\n\r\n");
+						content_length += part_headers.back().length() + range.last - range.first + 1;
+					}
+					std::string closing = "\r\n--" + boundary + "--\r\n";
+					content_length += closing.length();
+					headers.emplace_back("Content-Type", "multipart/byteranges; boundary=" + boundary);
+					headers.emplace_back("Content-Length", std::to_string(content_length));
+					ec = m_response.send_header("206 Partial Content", headers, false);
+					for (size_t i = 0; i < ranges.size() && !ec && send_body; ++i)
+					{
+						m_response.buffer_data(part_headers[i]);
+						ec = send_part(ranges[i].first, ranges[i].last - ranges[i].first + 1);
+					}
+					if (!ec && send_body)
+						m_response.buffer_data(closing);
+				}
+			}
+			else
+			{
+				headers.emplace_back("Content-Type", content_type);
+				headers.emplace_back("Content-Length", std::to_string(length));
+				ec = m_response.send_header("200 OK", headers, false);
+				if (!ec && send_body && length > 0)
+					ec = send_part(0, length);
 			}
+			// Send the rest of buffered output, e.g. the header for HEAD requests
+			if (!ec)
+				m_response.flush();
+		}
+
+		// Generate a random boundary for a multipart/byteranges response
+		static std::string multipart_boundary()
+		{
+			thread_local std::mt19937_64 generator{ std::random_device{}() };
+			return hex(static_cast<size_t>(generator())) + hex(static_cast<size_t>(generator()));
 		}
 
 	public:
-		StaticRequestHandler(req_t& request, resp_t& response, std::string& cache_control, bool use_gzip) :
-			m_cache_control { cache_control }, m_use_gzip{ use_gzip },
+		StaticRequestHandler(req_t& request, resp_t& response, std::string& cache_control, bool use_gzip, bool use_sendfile,
+				bool content_etags, FileCache& file_cache, LookupCache& lookup_cache, BlockingPool& blocking_pool) :
+			m_cache_control { cache_control }, m_use_gzip{ use_gzip }, m_use_sendfile{ use_sendfile }, m_content_etags{ content_etags },
+			m_file_cache{ file_cache }, m_lookup_cache{ lookup_cache }, m_blocking_pool{ blocking_pool },
 			BaseRequestHandler<req_t, resp_t>(request, response) {}
 
 		// Handle request
@@ -185,11 +329,32 @@ namespace wsgi_boost
 		{
 			if (m_request.method != "GET" && m_request.method != "HEAD")
 			{
-				m_response.send_mesage("405 Method Not Allowed", "Invalid HTTP method! Only GET and HEAD are allowed.");
+				m_response.send_error(405);
 				return;
 			}
-			const auto content_dir_path = boost::filesystem::path{ m_request.content_dir };
-			if (!boost::filesystem::exists(content_dir_path))
+			FileInfo info{};
+			FileStatus status;
+			bool fresh = false;
+			std::string key = lookup_key(m_request.content_dir, m_request.content_path);
+			bool found = m_lookup_cache.find(key, status, info, fresh);
+			if (found && !fresh)
+			{
+				// A known file is only checked for changes on this thread,
+				// its metadata are most likely in the OS cache
+				found = check_file(info);
+				if (found)
+					m_lookup_cache.update(key, info);
+			}
+			if (!found)
+			{
+				// Resolving a new path may block on disk I/O
+				run_blocking([this, &info, &status]()
+				{
+					status = lookup_file(m_request.content_dir, m_request.content_path, info);
+				});
+				m_lookup_cache.add(key, status, info);
+			}
+			if (status == INVALID_CONTENT_DIR)
 			{
 				m_response.send_html("500 Internal Server Error",
 					"Error 500",
@@ -197,7 +362,12 @@ namespace wsgi_boost
 					"Invalid static content directory is configured.");
 				return;
 			}
-			open_file(content_dir_path);
+			if (status == FILE_NOT_FOUND)
+			{
+				send_not_found();
+				return;
+			}
+			open_file(info, found);
 		}
 	};
 
@@ -211,7 +381,7 @@ namespace wsgi_boost
 	private:
 		std::string m_status;
 		out_headers_t m_out_headers;
-		pybind11::object& m_app;
+		const pybind11::object& m_app;
 		pybind11::dict m_environ;
 		pybind11::object m_write;
 		pybind11::object m_start_response;
@@ -283,9 +453,9 @@ namespace wsgi_boost
 		void prepare_environ()
 		{
 			m_environ["REQUEST_METHOD"] = m_request.method;
-			m_environ["SCRIPT_NAME"] = "";
+			m_environ["SCRIPT_NAME"] = m_request.script_name;
 			std::pair<std::string, std::string> path_and_query = split_path(m_request.path);
-			m_environ["PATH_INFO"] = path_and_query.first;
+			m_environ["PATH_INFO"] = path_and_query.first.substr(m_request.script_name.length());
 			m_environ["QUERY_STRING"] = path_and_query.second;
 			m_environ["CONTENT_TYPE"] = m_request.get_header("Content-Type");
 			m_environ["CONTENT_LENGTH"] = m_request.get_header("Content-Length");
@@ -295,14 +465,14 @@ namespace wsgi_boost
 			m_environ["REMOTE_ADDR"] = m_request.remote_address();
 			m_environ["REMOTE_HOST"] = m_request.remote_address();
 			m_environ["REMOTE_PORT"] = std::to_string(m_request.remote_port());
-			for (const auto& header : m_request.headers)
+			for (size_t i = 0; i < m_request.headers.size(); ++i)
 			{
-				std::string env_header = header.first;
+				std::string env_header = m_request.headers.name(i).to_string();
 				transform_header(env_header);
 				if (env_header == "HTTP_CONTENT_TYPE" || env_header == "HTTP_CONTENT_LENGTH")
 					continue;
 				// Headers are already checked for duplicates during parsing
-				m_environ[env_header.c_str()] = header.second;
+				m_environ[env_header.c_str()] = m_request.headers.value(i).to_string();
 			}
 			m_environ["wsgi.version"] = pybind11::make_tuple(1, 0);
 			m_environ["wsgi.url_scheme"] = m_url_scheme;
@@ -317,7 +487,7 @@ namespace wsgi_boost
 		boost::system::error_code send_header()
 		{
 			boost::system::error_code ec;
-			ec = m_response.send_header(m_status, m_out_headers);
+			ec = m_response.send_header(m_status, m_out_headers, false);
 			if (!(ec || m_write_data.empty()))
 				ec = m_response.send_data(m_write_data);
 			return ec;
@@ -356,6 +526,7 @@ namespace wsgi_boost
 					ec = m_response.send_data(chunk);
 					if (ec)
 						break;
+					m_request.trace.mark_once(TRACE_FIRST_BYTE);
 				}
 				catch (pybind11::error_already_set& ex)
 				{
@@ -370,6 +541,8 @@ namespace wsgi_boost
 								ec = send_header();
 							if (!ec && m_content_length == -1)
 								m_response.send_data("0\r\n\r\n");
+							else if (!ec)
+								m_response.flush();
 						}
 						break;
 					}
@@ -379,7 +552,7 @@ namespace wsgi_boost
 		}
 
 	public:
-		WsgiRequestHandler(req_t& request, resp_t& response, pybind11::object& app,
+		WsgiRequestHandler(req_t& request, resp_t& response, const pybind11::object& app,
 			std::string& scheme, std::string& host, unsigned short local_port, bool multithread) :
 			BaseRequestHandler<req_t, resp_t>(request, response), m_app{ app },
 			m_url_scheme{ scheme }, m_host_name{ host },
@@ -396,6 +569,7 @@ namespace wsgi_boost
 				throw std::runtime_error("A WSGI application is not set!");
 			prepare_environ();
 			Iterable iterable{ m_app(m_environ, m_start_response) };
+			m_request.trace.mark(TRACE_APP_RETURNED);
 			send_iterable(iterable);
 		}
 	};
@@ -8,12 +8,13 @@ License: MIT, see License.txt
 
 #include "connection.h"
 #include "utils.h"
+#include "error_pages.h"
 
 #include <boost/system/error_code.hpp>
-#include <boost/format.hpp>
 
 #include <vector>
 #include <string>
+#include <cstdlib>
 
 
 namespace wsgi_boost
@@ -27,21 +28,36 @@ namespace wsgi_boost
 	private:
 		const std::string m_server_name = "WsgiBoost v." WSGI_BOOST_VERSION;
 		conn_t& m_connection;
+		const ErrorPages& m_error_pages;
 		bool m_header_sent = false;
+		size_t m_initial_bytes_sent;
+		size_t m_header_size = 0;
+
+		void buffer_header(const std::string& data)
+		{
+			m_connection.buffer_output(data);
+			m_header_size += data.length();
+		}
 
 	public:
 		std::string http_version = "HTTP/1.1";
 		bool keep_alive;
+		int status_code = 0;
 
 		Response(const Response&) = delete;
 		Response& operator=(const Response&) = delete;
 
-		explicit Response(conn_t& connection) : m_connection{ connection } {}
+		Response(conn_t& connection, const ErrorPages& error_pages) :
+			m_connection{ connection }, m_error_pages{ error_pages }, m_initial_bytes_sent{ connection.bytes_sent() } {}
 
 		// Send HTTP header (status code + headers)
-		boost::system::error_code send_header(const std::string& status, out_headers_t& headers)
+		//
+		// If flush is false, the header is kept in the output buffer
+		// and sent together with the first chunk of the response body.
+		boost::system::error_code send_header(const std::string& status, out_headers_t& headers, bool flush = true)
 		{
-			m_connection.buffer_output(http_version + " " + status + "\r\n");
+			status_code = std::atoi(status.c_str());
+			buffer_header(http_version + " " + status + "\r\n");
 			headers.emplace_back("Server", m_server_name);
 			headers.emplace_back("Date", get_current_gmt_time());
 			if (keep_alive)
@@ -49,10 +65,18 @@ namespace wsgi_boost
 			else
 				headers.emplace_back("Connection", "close");
 			for (const auto& header : headers)
-				m_connection.buffer_output(header.first + ": " + header.second + "\r\n");
-			m_connection.buffer_output("\r\n");
+				buffer_header(header.first + ": " + header.second + "\r\n");
+			buffer_header("\r\n");
 			m_header_sent = true;
-			return m_connection.flush();
+			if (flush)
+				return m_connection.flush();
+			return boost::system::error_code();
+		}
+
+		// Save data to the output buffer, it is sent with the next data
+		void buffer_data(const std::string& data)
+		{
+			m_connection.buffer_output(data);
 		}
 
 		// Send data to the client
@@ -62,6 +86,35 @@ namespace wsgi_boost
 			return m_connection.flush();
 		}
 
+		boost::system::error_code send_data(const char* data, size_t length)
+		{
+			m_connection.buffer_output(data, length);
+			return m_connection.flush();
+		}
+
+		// Send data without copying it, the data must stay valid until the call returns
+		boost::system::error_code send_buffer(const char* data, size_t length)
+		{
+			return m_connection.send_buffer(data, length);
+		}
+
+#ifdef __linux__
+		// Send a part of a file to the client
+		boost::system::error_code send_file(int fd, off_t offset, size_t length)
+		{
+			return m_connection.send_file(fd, offset, length);
+		}
+#endif
+
+		// Check if files can be sent with zero-copy send_file()
+		static bool sendfile_supported() { return conn_t::sendfile_supported(); }
+
+		// Send buffered data, if any, to the client
+		boost::system::error_code flush()
+		{
+			return m_connection.flush();
+		}
+
 		// Send a plain text HTTP message to a client
 		boost::system::error_code send_mesage(const std::string& status, const std::string& message = std::string())
 		{
@@ -69,23 +122,39 @@ namespace wsgi_boost
 			headers.emplace_back("Content-Length", std::to_string(message.length()));
 			if (!message.empty())
 				headers.emplace_back("Content-Type", "text/plain");
-			boost::system::error_code ec = send_header(status, headers);
+			boost::system::error_code ec = send_header(status, headers, false);
 			if (!ec)
 				ec = send_data(message);
 			return ec;
 		}
 
+		// Send a pre-rendered error response to a client
+		//
+		// Only the Date header and extra header lines are added to the page,
+		// and the whole response is sent in one write.
+		boost::system::error_code send_error(int status, const std::string& extra_headers = std::string())
+		{
+			const ErrorPage& page = m_error_pages.get(status);
+			status_code = status;
+			buffer_header(http_version);
+			buffer_header(page.head);
+			buffer_header(date_header());
+			buffer_header(extra_headers);
+			m_header_sent = true;
+			const std::string& tail = keep_alive ? page.keep_alive : page.close;
+			m_header_size += tail.find("\r\n\r\n") + 4;
+			return m_connection.send_buffer(tail.data(), tail.length());
+		}
+
 		// Send a html HTTP message to a client
 		boost::system::error_code send_html(const std::string& status, const std::string& title,
 			const std::string& header, const std::string& text)
 		{
-			boost::format tpl{ html_template };
-			tpl % title % header % text;
-			std::string html = tpl.str();
+			std::string html = render_html(title, header, text);
 			out_headers_t headers;
 			headers.emplace_back("Content-Type", "text/html");
 			headers.emplace_back("Content-Length", std::to_string(html.length()));
-			boost::system::error_code ec = send_header(status, headers);
+			boost::system::error_code ec = send_header(status, headers, false);
 			if (!ec)
 				ec = send_data(html);
 			return ec;
@@ -93,5 +162,15 @@ namespace wsgi_boost
 
 		// Check if HTTP header has been sent
 		bool header_sent() const { return m_header_sent; }
+
+		// Get the number of bytes sent for this response including the header
+		size_t bytes_sent() const { return m_connection.bytes_sent() - m_initial_bytes_sent; }
+
+		// Get the number of bytes of the response body sent
+		size_t body_bytes_sent() const
+		{
+			size_t bytes = bytes_sent();
+			return bytes > m_header_size ? bytes - m_header_size : 0;
+		}
 	};
 }
@@ -0,0 +1,283 @@
+#pragma once
+/*
+Route tables
+
+Copyright (c) 2017 Roman Miroshnychenko <romanvm@yandex.ua>
+License: MIT, see License.txt
+*/
+
+#include <pybind11/pybind11.h>
+#include <boost/regex.hpp>
+#include <boost/algorithm/string.hpp>
+
+#include <unordered_map>
+#include <vector>
+#include <string>
+#include <utility>
+#include <cctype>
+
+
+namespace wsgi_boost
+{
+	// Prefix tree that maps literal path prefixes to route indexes
+	class PrefixTrie
+	{
+	private:
+		struct Node
+		{
+			std::vector<std::pair<char, size_t>> children;
+			size_t route = std::string::npos;
+		};
+
+		std::vector<Node> m_nodes;
+		bool m_icase;
+
+		char normalize(char ch) const
+		{
+			if (m_icase)
+				return static_cast<char>(std::tolower(static_cast<unsigned char>(ch)));
+			return ch;
+		}
+
+		size_t child(size_t node, char ch) const
+		{
+			for (const auto& c : m_nodes[node].children)
+			{
+				if (c.first == ch)
+					return c.second;
+			}
+			return std::string::npos;
+		}
+
+	public:
+		explicit PrefixTrie(bool icase = true) : m_nodes(1), m_icase{ icase } {}
+
+		// Add a prefix and return the route stored for it.
+		// If the prefix is already present the first route is kept.
+		size_t insert(const std::string& prefix, size_t route)
+		{
+			size_t node = 0;
+			for (auto ch : prefix)
+			{
+				ch = normalize(ch);
+				size_t next = child(node, ch);
+				if (next == std::string::npos)
+				{
+					next = m_nodes.size();
+					m_nodes.emplace_back();
+					m_nodes[node].children.emplace_back(ch, next);
+				}
+				node = next;
+			}
+			if (m_nodes[node].route == std::string::npos)
+				m_nodes[node].route = route;
+			return m_nodes[node].route;
+		}
+
+		// Call visit(prefix_length, route) for every stored prefix of str, shortest first
+		template <class Visitor>
+		void walk(const std::string& str, Visitor visit) const
+		{
+			size_t node = 0;
+			for (size_t i = 0; ; ++i)
+			{
+				if (m_nodes[node].route != std::string::npos)
+					visit(i, m_nodes[node].route);
+				if (i == str.length())
+					break;
+				node = child(node, normalize(str[i]));
+				if (node == std::string::npos)
+					break;
+			}
+		}
+	};
+
+
+	// Check if a regex is a plain prefix anchored at the beginning of a string, e.g. ^/static,
+	// and extract the literal prefix
+	inline bool regex_to_prefix(const std::string& pattern, std::string& prefix)
+	{
+		const std::string special_chars = ".[]{}()*+?|^$";
+		if (pattern.empty() || pattern[0] != '^')
+			return false;
+		prefix.clear();
+		for (size_t i = 1; i < pattern.length(); ++i)
+		{
+			char ch = pattern[i];
+			if (ch == '\\')
+			{
+				// Only escaped punctuation is literal, e.g. \. or \/
+				if (++i == pattern.length() || std::isalnum(static_cast<unsigned char>(pattern[i])))
+					return false;
+				ch = pattern[i];
+			}
+			else if (special_chars.find(ch) != std::string::npos)
+			{
+				return false;
+			}
+			prefix += ch;
+		}
+		return true;
+	}
+
+
+	// Static content routes
+	//
+	// Plain prefix routes are looked up in a prefix tree and only true patterns
+	// are matched with boost::regex. As before, the first added matching route wins.
+	class StaticRoutes
+	{
+	private:
+		struct Route
+		{
+			boost::regex regex;
+			std::string content_dir;
+		};
+
+		std::vector<Route> m_routes;
+		PrefixTrie m_prefixes;
+		std::vector<size_t> m_regex_routes;
+
+	public:
+		// Add a route
+		void add(const std::string& path, const std::string& content_dir)
+		{
+			size_t index = m_routes.size();
+			m_routes.push_back(Route{ boost::regex(path, boost::regex_constants::icase), content_dir });
+			std::string prefix;
+			if (regex_to_prefix(path, prefix))
+				m_prefixes.insert(prefix, index);
+			else
+				m_regex_routes.push_back(index);
+		}
+
+		// Find a route for the path
+		//
+		// Returns a pointer to the content directory or nullptr if no route matches.
+		// match_pos and match_len are set to the matched part of the path.
+		const std::string* match(const std::string& path, size_t& match_pos, size_t& match_len) const
+		{
+			size_t found = std::string::npos;
+			size_t prefix_len = 0;
+			m_prefixes.walk(path, [&found, &prefix_len](size_t length, size_t route)
+			{
+				if (route < found)
+				{
+					found = route;
+					prefix_len = length;
+				}
+			});
+			for (auto index : m_regex_routes)
+			{
+				if (index > found)
+					break;
+				boost::smatch match;
+				if (boost::regex_search(path, match, m_routes[index].regex))
+				{
+					match_pos = match.position();
+					match_len = match.length();
+					return &m_routes[index].content_dir;
+				}
+			}
+			if (found == std::string::npos)
+				return nullptr;
+			match_pos = 0;
+			match_len = prefix_len;
+			return &m_routes[found].content_dir;
+		}
+	};
+
+
+	// WSGI applications mounted by Host header and path prefix
+	//
+	// Routes for a specific host take precedence over routes for any host,
+	// and the longest path prefix that ends on a path segment boundary wins.
+	class AppRoutes
+	{
+	private:
+		struct Route
+		{
+			pybind11::object app;
+			std::string script_name;
+		};
+
+		std::vector<Route> m_routes;
+		// Lowercase host name without port -> path prefixes; "" is for any host
+		std::unordered_map<std::string, PrefixTrie> m_hosts;
+
+		// Strip a port from a Host header value
+		static std::string normalize_host(const std::string& host)
+		{
+			size_t end;
+			if (!host.empty() && host[0] == '[')
+			{
+				// IPv6 literal
+				end = host.find(']');
+				if (end != std::string::npos)
+					++end;
+			}
+			else
+			{
+				end = host.find(':');
+			}
+			return boost::algorithm::to_lower_copy(host.substr(0, end));
+		}
+
+		const Route* match_host(const std::string& host, const std::string& path) const
+		{
+			auto it = m_hosts.find(host);
+			if (it == m_hosts.end())
+				return nullptr;
+			size_t path_end = path.find('?');
+			if (path_end == std::string::npos)
+				path_end = path.length();
+			size_t found = std::string::npos;
+			it->second.walk(path, [&found, &path, path_end](size_t length, size_t route)
+			{
+				if (length == 0 || length == path_end || (length < path_end && path[length] == '/'))
+					found = route;
+			});
+			if (found == std::string::npos)
+				return nullptr;
+			return &m_routes[found];
+		}
+
+	public:
+		// Add or replace an app for a host and a path prefix
+		void add(const pybind11::object& app, std::string path, const std::string& host)
+		{
+			while (!path.empty() && path.back() == '/')
+				path.pop_back();
+			if (!path.empty() && path[0] != '/')
+				throw std::invalid_argument("An app path must start with '/'!");
+			std::string host_name = normalize_host(host);
+			auto it = m_hosts.find(host_name);
+			if (it == m_hosts.end())
+				it = m_hosts.emplace(host_name, PrefixTrie{ false }).first;
+			size_t index = it->second.insert(path, m_routes.size());
+			if (index == m_routes.size())
+				m_routes.push_back(Route{ app, path });
+			else
+				m_routes[index].app = app;
+		}
+
+		// Find an app for the Host header and the path
+		//
+		// Returns nullptr if no app matches, otherwise sets script_name
+		// to the matched path prefix.
+		const pybind11::object* match(const std::string& host, const std::string& path, std::string& script_name) const
+		{
+			if (m_routes.empty())
+				return nullptr;
+			const Route* route = nullptr;
+			if (!host.empty())
+				route = match_host(normalize_host(host), path);
+			if (!route)
+				route = match_host(std::string(), path);
+			if (!route)
+				return nullptr;
+			script_name = route->script_name;
+			return &route->app;
+		}
+	};
+}
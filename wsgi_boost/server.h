@@ -8,9 +8,12 @@ License: MIT, see License.txt
 
 #include "request_handlers.h"
 #include "io_service_pool.h"
+#include "routes.h"
+#include "access_log.h"
 
 #include <boost/asio/spawn.hpp>
 
+#include <array>
 #include <memory>
 #include <csignal>
 #include <utility>
@@ -18,6 +21,7 @@ License: MIT, see License.txt
 #include <string>
 #include <vector>
 #include <atomic>
+#include <chrono>
 
 
 namespace wsgi_boost
@@ -36,9 +40,26 @@ namespace wsgi_boost
 		std::string m_address;
 		unsigned short m_port;
 		boost::asio::signal_set m_signals;
-		std::vector<std::pair<boost::regex, std::string>> m_static_routes;
+		StaticRoutes m_static_routes;
+		std::vector<std::string> m_preload_dirs;
 		pybind11::object m_app;
+		AppRoutes m_app_routes;
 		std::atomic_bool m_is_running;
+		std::atomic<unsigned int> m_connections;
+		std::atomic<unsigned int> m_wsgi_requests;
+		std::atomic<unsigned long long> m_shed_connections;
+		std::atomic<unsigned long long> m_shed_requests;
+		ErrorPages m_error_pages;
+		// Pre-serialized "503 Service Unavailable" response for load shedding without Date header
+		std::string m_overload_head;
+		std::string m_overload_tail;
+		Tracer m_tracer;
+		AccessLog m_access_log;
+		FileCache m_file_cache;
+		LookupCache m_lookup_cache;
+		// Declared after the io_service pool to finish blocking tasks
+		// before suspended coroutines are destroyed
+		BlockingPool m_blocking_pool;
 
 		void init_acceptor(boost::asio::ip::tcp::acceptor& acceptor, unsigned int port)
 		{
@@ -65,10 +86,28 @@ namespace wsgi_boost
 			acceptor.listen();
 		}
 
+		void wait_signals()
+		{
+			m_signals.async_wait([this](const boost::system::error_code& ec, int signal)
+			{
+				if (ec == boost::asio::error::operation_aborted)
+					return;
+#if defined(SIGHUP)
+				if (signal == SIGHUP)
+				{
+					m_access_log.reopen();
+					wait_signals();
+					return;
+				}
+#endif
+				stop();
+			});
+		}
+
 		// Pybind11 cannot expose abstract C++ classes
 		virtual void accept() { };
 
-		virtual void process_request(socket_p socket)
+		virtual void process_request(socket_p socket, unsigned int requests_served = 0)
 		{
 			// A stackful coroutine is needed here to correctly implement keep-alive
 			// in case if the number of concurent requests is greater than
@@ -80,48 +119,187 @@ namespace wsgi_boost
 			// with no special syncronization measures. This also allows us to safely
 			// toggle Python GIL around async operations
 			// without the risk of crashing Python interpreter.
-			boost::asio::spawn(socket->get_io_service(), [this, socket](boost::asio::yield_context yc)
+			boost::asio::spawn(get_io_service(*socket), [this, socket, requests_served](boost::asio::yield_context yc)
 			{
 				connection_t connection{ socket, yc, header_timeout, content_timeout };
-				request_t request{ connection };
-				response_t response{ connection };
-				parse_result res = request.parse_header();
-				if (!res)
+				RequestLimits limits{ max_header_size, max_header_count, max_body_size };
+				unsigned int request_count = requests_served;
+				while (true)
 				{
-					check_static_route(request);
-					response.http_version = request.http_version;
-					response.keep_alive = request.keep_alive();
-					handle_request(request, response);
-				}
-				else if (res == BAD_REQUEST)
-				{
-					response.send_mesage("400 Bad Request", "Malformed HTTP request!");
+					request_t request{ connection };
+					response_t response{ connection, m_error_pages };
+					request.trace.start(m_tracer.enabled());
+					parse_result res = request.parse_header(limits);
+					if (!res)
+					{
+						request.trace.mark(TRACE_HEADER_READ);
+						auto started = std::chrono::steady_clock::now();
+						++request_count;
+						check_static_route(request);
+						response.http_version = request.http_version;
+						response.keep_alive = request.keep_alive() &&
+							(max_keepalive_requests == 0 || request_count < max_keepalive_requests);
+						handle_request(request, response);
+						request.trace.mark(TRACE_END);
+						m_tracer.add(request.method, request.path, request.trace);
+						if (m_access_log.enabled())
+						{
+							m_access_log.log(request, response, std::chrono::duration_cast<std::chrono::microseconds>(
+								std::chrono::steady_clock::now() - started).count());
+						}
+					}
+					else if (res == BAD_REQUEST)
+					{
+						response.keep_alive = false;
+						response.send_error(400);
+					}
+					else if (res == LENGTH_REQUIRED)
+					{
+						response.keep_alive = false;
+						response.send_error(411);
+					}
+					else if (res == HEADER_TOO_LARGE)
+					{
+						response.keep_alive = false;
+						response.send_error(431);
+					}
+					else if (res == PAYLOAD_TOO_LARGE)
+					{
+						// The connection is closed without reading the content
+						response.keep_alive = false;
+						response.send_error(413);
+					}
+					else
+					{
+						return;
+					}
+					if (res)
+					{
+						// A rejected request may be followed by unread input
+						lingering_close(socket);
+						return;
+					}
+					// Re-use the socket for the next request if this is a keep-alive session
+					// and the request content has been read completely.
+					if (!response.keep_alive || !connection.content_consumed())
+						return;
+					// An idle connection waits for the next request without a coroutine, if possible.
+					// Pipelined requests that are already buffered are processed right away.
+					if (!connection.has_buffered_input() && park_connection(socket, request_count))
+						return;
+					// Only the wait for the next request may take keepalive_timeout
+					if (connection.wait_for_input(keepalive_timeout))
+						return;
 				}
-				else if (res == LENGTH_REQUIRED)
+			});
+		}
+
+		// Wait for the next keep-alive request outside of a coroutine
+		//
+		// Returns false if this is not supported for the socket type.
+		virtual bool park_connection(socket_p, unsigned int) { return false; }
+
+		// Wrap an accepted socket to count it as an open connection while it is in use
+		socket_p count_connection(socket_p socket)
+		{
+			++m_connections;
+			return socket_p{ socket.get(), [this, socket](typename socket_p::element_type*) { --m_connections; } };
+		}
+
+		// Check if the number of open connections exceeds the limit
+		bool connections_exceeded() const
+		{
+			return max_connections > 0 && m_connections.load() > max_connections;
+		}
+
+		// State of a connection that discards input before closing
+		struct Linger
+		{
+			socket_p socket;
+			TimerWheel::Timeout timeout;
+			std::array<char, 4096> buffer;
+			size_t bytes_left = 262144;
+
+			explicit Linger(socket_p sock) : socket{ sock } {}
+		};
+
+		static void discard_input(std::shared_ptr<Linger> linger)
+		{
+			linger->socket->async_read_some(boost::asio::buffer(linger->buffer),
+				[linger](const boost::system::error_code& ec, size_t bytes_read)
+			{
+				if (!ec && bytes_read < linger->bytes_left)
 				{
-					response.send_mesage("411 Length Required", "Content-Length header is missing!");
+					linger->bytes_left -= bytes_read;
+					discard_input(linger);
+					return;
 				}
-				else
+				linger->timeout.cancel();
+				boost::system::error_code close_ec;
+				linger->socket->lowest_layer().close(close_ec);
+			});
+		}
+
+		// Close a connection after an error response without resetting it
+		//
+		// Closing a socket with unread input makes the kernel send RST, and a client may then
+		// discard the response before reading it. So sending is shut down first, and input
+		// is discarded until the client closes the connection, for at most 2s and 256KB.
+		static void lingering_close(socket_p socket)
+		{
+			boost::system::error_code ec;
+			socket->lowest_layer().shutdown(boost::asio::ip::tcp::socket::shutdown_send, ec);
+			if (ec)
+			{
+				socket->lowest_layer().close(ec);
+				return;
+			}
+			auto linger = std::make_shared<Linger>(socket);
+			boost::asio::use_service<TimerWheel>(get_io_service(*socket)).schedule(linger->timeout, 2, [socket]()
+			{
+				boost::system::error_code ec;
+				socket->lowest_layer().close(ec);
+			});
+			discard_input(linger);
+		}
+
+		// Send the pre-serialized 503 response to an excess connection and close it
+		void shed_connection(socket_p socket)
+		{
+			++m_shed_connections;
+			// The cached Date header of this thread may change before the write completes
+			auto date = std::make_shared<std::string>(date_header());
+			std::array<boost::asio::const_buffer, 3> buffers = { {
+				boost::asio::buffer(m_overload_head), boost::asio::buffer(*date), boost::asio::buffer(m_overload_tail) } };
+			boost::asio::async_write(*socket, buffers, [socket, date](const boost::system::error_code& ec, size_t)
+			{
+				if (ec)
 				{
+					boost::system::error_code close_ec;
+					socket->lowest_layer().close(close_ec);
 					return;
 				}
-				// Send all remaining data from the output buffer and re-use the socket
-				// for the next request if this is a keep-alive session.
-				if (response.keep_alive)
-					process_request(socket);
+				lingering_close(socket);
 			});
 		}
 
+		void render_error_pages()
+		{
+			m_error_pages.render(retry_after);
+			const ErrorPage& page = m_error_pages.get(503);
+			m_overload_head = "HTTP/1.1" + page.head;
+			m_overload_tail = page.close;
+		}
+
 		void check_static_route(request_t& request)
 		{
-			for (const auto& route : m_static_routes)
+			size_t match_pos;
+			size_t match_len;
+			const std::string* content_dir = m_static_routes.match(request.path, match_pos, match_len);
+			if (content_dir)
 			{
-				if (boost::regex_search(request.path, route.first))
-				{
-					request.path_regex = route.first;
-					request.content_dir = route.second;
-					break;
-				}
+				request.content_dir = *content_dir;
+				request.content_path = request.path.substr(0, match_pos) + request.path.substr(match_pos + match_len);
 			}
 		}
 
@@ -129,7 +307,7 @@ namespace wsgi_boost
 		{
 			std::cerr << error_msg << ": " << ex.what() << '\n';
 			if (!response.header_sent())
-				response.send_html("500 Internal Server Error", "Error 500", "Internal Server Error", error_msg);
+				response.send_error(500);
 			else
 				// Do not reuse a socket on a fatal error
 				response.keep_alive = false;
@@ -139,6 +317,14 @@ namespace wsgi_boost
 		{
 			if (request.content_dir.empty())
 			{
+				ScopedCounter<unsigned int> wsgi_request{ m_wsgi_requests };
+				if (max_wsgi_requests > 0 && wsgi_request.value() > max_wsgi_requests)
+				{
+					++m_shed_requests;
+					response.keep_alive = false;
+					response.send_error(503);
+					return;
+				}
 				// Try to buffer the first 128KB of request data
 				if (request.connection().post_content_length() > 0)
 				{
@@ -153,9 +339,14 @@ namespace wsgi_boost
 						return;
 					}
 				}
+				const pybind11::object* app = m_app_routes.match(request.get_header("Host"), request.path, request.script_name);
+				if (!app)
+					app = &m_app;
+				request.trace.mark(TRACE_GIL_WAIT);
 				pybind11::gil_scoped_acquire acquire_gil;
+				request.trace.mark(TRACE_APP_START);
 				WsgiRequestHandler<connection_t, request_t, response_t> handler{
-					request, response, m_app, url_scheme, host_name, m_port, m_io_service_pool.size() > 1
+					request, response, *app, url_scheme, host_name, m_port, m_io_service_pool.size() > 1
 					};
 				try
 				{
@@ -177,7 +368,7 @@ namespace wsgi_boost
 			}
 			else
 			{
-				StaticRequestHandler<request_t, response_t> handler{ request, response, static_cache_control, use_gzip };
+				StaticRequestHandler<request_t, response_t> handler{ request, response, static_cache_control, use_gzip, use_sendfile, content_etags, m_file_cache, m_lookup_cache, m_blocking_pool };
 				try
 				{
 					handler.handle();
@@ -192,11 +383,29 @@ namespace wsgi_boost
 	public:
 		unsigned int header_timeout = 5;
 		unsigned int content_timeout = 300;
+		unsigned int keepalive_timeout = 15;
+		unsigned int max_keepalive_requests = 0;
+		size_t max_header_size = 65536;
+		unsigned int max_header_count = 100;
+		unsigned long long max_body_size = 0;
 		bool reuse_address = true;
 		std::string url_scheme = "http";
 		std::string host_name;
 		bool use_gzip = true;
+		bool use_sendfile = true;
+		bool content_etags = false;
+		size_t static_cache_size = 268435456;
+		size_t static_cache_max_file_size = 16777216;
+		unsigned int file_io_threads = 4;
+		unsigned int static_lookup_ttl = 0;
+		unsigned int static_not_found_ttl = 1000;
 		std::string static_cache_control = "public, max-age=3600";
+		unsigned int max_connections = 0;
+		unsigned int max_wsgi_requests = 0;
+		unsigned int retry_after = 1;
+		unsigned int trace_buffer_size = 4096;
+		std::string access_log;
+		std::string access_log_format = default_access_log_format;
 
 		BaseServer(const BaseServer&) = delete;
 		BaseServer& operator=(const BaseServer&) = delete;
@@ -209,6 +418,10 @@ namespace wsgi_boost
 			m_acceptor{ *m_io_service_pool.get_io_service() }, m_signals{ *m_io_service_pool.get_io_service() }
 		{
 			m_is_running.store(false);
+			m_connections.store(0);
+			m_wsgi_requests.store(0);
+			m_shed_connections.store(0);
+			m_shed_requests.store(0);
 			m_signals.add(SIGINT);
 			m_signals.add(SIGTERM);
 #if defined(SIGQUIT)
@@ -217,17 +430,98 @@ namespace wsgi_boost
 		}
 
 		// Add a path to static content
-		void add_static_route(std::string path, std::string content_dir)
+		void add_static_route(std::string path, std::string content_dir, bool preload = false)
 		{
-			m_static_routes.emplace_back(boost::regex(path, boost::regex_constants::icase), content_dir);
+			m_static_routes.add(path, content_dir);
+			if (preload)
+				m_preload_dirs.push_back(content_dir);
+		}
+
+		// Set a custom body for an error response, e.g. 404 or 500
+		void set_error_page(int status_code, std::string content, std::string content_type = "text/html")
+		{
+			if (is_running())
+				throw std::runtime_error("Cannot set an error page while the server is running!");
+			m_error_pages.set_body(status_code, content, content_type);
 		}
 
 		// Set WSGI application
-		void set_app(pybind11::object app)
+		//
+		// An app with a non-empty path and/or host is mounted at that path prefix
+		// and/or Host header, otherwise it becomes the default app.
+		void set_app(pybind11::object app, std::string path = std::string(), std::string host = std::string())
 		{
 			if (is_running())
 				throw std::runtime_error("Cannot set a WSGI app while the server is running!");
-			m_app = app;
+			if (path.empty() && host.empty())
+				m_app = app;
+			else
+				m_app_routes.add(app, path, host);
+		}
+
+		// Fill static file caches for routes with preload enabled before accepting connections
+		//
+		// Files are processed in parallel by as many threads as the server has.
+		void preload_static_files()
+		{
+			if (m_preload_dirs.empty())
+				return;
+			auto started = std::chrono::steady_clock::now();
+			// Files are preloaded with the same lookup keys as request paths of static routes
+			std::vector<std::pair<std::string, std::string>> files;
+			for (const auto& dir : m_preload_dirs)
+			{
+				size_t dir_length = boost::filesystem::path{ dir }.generic_string().length();
+				boost::system::error_code ec;
+				for (boost::filesystem::recursive_directory_iterator it{ dir, ec }, end; !ec && it != end; it.increment(ec))
+				{
+					boost::system::error_code file_ec;
+					if (!boost::filesystem::is_regular_file(it->path(), file_ec))
+						continue;
+					files.emplace_back(dir, it->path().generic_string().substr(dir_length));
+				}
+				if (ec)
+					std::cerr << "Unable to preload static files from " << dir << ": " << ec.message() << '\n';
+			}
+			bool read_files = !(use_sendfile && connection_t::sendfile_supported());
+			std::atomic<size_t> next_file{ 0 };
+			std::atomic<size_t> found{ 0 };
+			std::atomic<size_t> contents{ 0 };
+			std::atomic<size_t> etags{ 0 };
+			std::atomic<size_t> compressed{ 0 };
+			auto preload = [this, &files, &next_file, read_files, &found, &contents, &etags, &compressed]()
+			{
+				size_t i;
+				while ((i = next_file++) < files.size())
+				{
+					FileInfo info{};
+					FileStatus status = lookup_file(files[i].first, files[i].second, info);
+					m_lookup_cache.add(lookup_key(files[i].first, files[i].second), status, info);
+					if (status != FILE_FOUND)
+						continue;
+					++found;
+					// Contents are not needed if files are sent with sendfile()
+					if (read_files && m_file_cache.get(info.path, info.last_modified, info.file_size))
+						++contents;
+					if (content_etags && !m_file_cache.get_etag(info.path, info.last_modified, info.file_size).empty())
+						++etags;
+					// Compressed variants of files that are too large for the cache are not kept
+					if (use_gzip && m_file_cache.cacheable(info.file_size) &&
+						is_compressable(boost::filesystem::path{ info.path }.extension().string()) &&
+						m_file_cache.get_gzip(info.path, info.last_modified, info.file_size))
+						++compressed;
+				}
+			};
+			std::vector<std::thread> threads;
+			for (size_t i = 1; i < m_io_service_pool.size(); ++i)
+				threads.emplace_back(preload);
+			preload();
+			for (auto& thread : threads)
+				thread.join();
+			auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - started);
+			std::cout << "Preloaded " << found << " static file(s): " << contents << " contents, " <<
+				compressed << " compressed variants, " << etags << " ETags, " << m_file_cache.size() / 1024 <<
+				"KB cached in " << elapsed.count() << "ms\n";
 		}
 
 		// Start handling HTTP requests
@@ -237,17 +531,36 @@ namespace wsgi_boost
 			{
 				pybind11::gil_scoped_release release_gil;
 				m_io_service_pool.reset();
+				render_error_pages();
+				if (m_tracer.capacity() < trace_buffer_size || m_tracer.capacity() / 2 >= trace_buffer_size)
+					m_tracer.resize(trace_buffer_size);
+				m_file_cache.configure(static_cache_size, static_cache_max_file_size);
+				m_lookup_cache.configure(static_lookup_ttl, static_not_found_ttl);
+				m_blocking_pool.start(file_io_threads);
+				preload_static_files();
+				if (!access_log.empty())
+					m_access_log.start(access_log, access_log_format);
+#if defined(SIGHUP)
+				// SIGHUP re-opens the access log after rotation
+				boost::system::error_code ec;
+				if (!access_log.empty())
+					m_signals.add(SIGHUP, ec);
+				else
+					m_signals.remove(SIGHUP, ec);
+#endif
 				init_acceptor(m_acceptor, m_port);
 				if (host_name.empty())
 					host_name = boost::asio::ip::host_name();
 				accept();
-				m_signals.async_wait([this](boost::system::error_code, int) { stop(); });
+				wait_signals();
 				std::cout << "WsgiBoost server is starting on " << host_name << ':' << m_port << " with " <<
 					m_io_service_pool.size() << " thread(s)\n";
 				std::cout << "Press Ctrl+C to stop it.\n";
 				m_is_running.store(true);
 				m_io_service_pool.run();
 				m_is_running.store(false);
+				m_blocking_pool.stop();
+				m_access_log.stop();
 				std::cout << "WsgiBoost server stopped.\n";
 			}
 			else
@@ -276,6 +589,40 @@ namespace wsgi_boost
 		{
 			return m_is_running.load();
 		}
+
+		// Get the number of open connections
+		unsigned int connections() const { return m_connections.load(); }
+
+		// Get the number of WSGI requests being processed
+		unsigned int wsgi_requests() const { return m_wsgi_requests.load(); }
+
+		// Get the number of connections rejected because of max_connections limit
+		unsigned long long shed_connections() const { return m_shed_connections.load(); }
+
+		// Get the number of requests rejected because of max_wsgi_requests limit
+		unsigned long long shed_requests() const { return m_shed_requests.load(); }
+
+		// Get the total size of cached static file contents in bytes
+		size_t static_cache_used() const { return m_file_cache.size(); }
+
+		// Get the number of access log lines dropped because of full buffers
+		unsigned long long access_log_dropped() const { return m_access_log.dropped(); }
+
+		// Check if request tracing is enabled
+		bool tracing() const { return m_tracer.enabled(); }
+
+		// Enable or disable request tracing
+		void set_tracing(bool enabled) { m_tracer.enable(enabled); }
+
+		// Get recorded request traces
+		pybind11::list get_traces() const { return m_tracer.get_traces(); }
+
+		// Write recorded request traces to a file in Chrome trace format
+		void dump_traces(const std::string& filename) const
+		{
+			pybind11::gil_scoped_release release_gil;
+			m_tracer.dump_chrome_trace(filename);
+		}
 	};
 
 	template<class socket_p>
@@ -301,11 +648,35 @@ namespace wsgi_boost
 				if (!ec)
 				{
 					socket->lowest_layer().set_option(boost::asio::ip::tcp::no_delay(true));
-					process_request(socket);
+					socket_ptr counted_socket = count_connection(socket);
+					if (connections_exceeded())
+						shed_connection(counted_socket);
+					else
+						process_request(counted_socket);
 				}
 			});
 		}
 
+		// Idle keep-alive connection only holds its socket until the socket becomes readable
+		bool park_connection(socket_ptr socket, unsigned int requests_served)
+		{
+			auto timeout = std::make_shared<TimerWheel::Timeout>();
+			boost::asio::use_service<TimerWheel>(get_io_service(*socket)).schedule(*timeout, keepalive_timeout, [socket]()
+			{
+				boost::system::error_code ec;
+				socket->shutdown(boost::asio::ip::tcp::socket::shutdown_both, ec);
+				socket->close(ec);
+			});
+			socket->async_read_some(boost::asio::null_buffers(),
+				[this, socket, timeout, requests_served](const boost::system::error_code& ec, size_t)
+			{
+				timeout->cancel();
+				if (!ec)
+					process_request(socket, requests_served);
+			});
+			return true;
+		}
+
 	public:
 		HttpServer(std::string address = "", unsigned short port = 8000, unsigned int threads = 0) :
 			BaseServer<socket_ptr>(address, port, threads) {}
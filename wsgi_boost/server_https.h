@@ -8,6 +8,7 @@ License: MIT, see License.txt
 #ifdef HTTPS_ENABLED
 
 #include "server.h"
+#include "tls.h"
 
 // This is needed to link against pre-built OpenSSL from https://slproweb.com/products/Win32OpenSSL.html
 #if _MSC_VER && _MSC_VER >= 1900
@@ -16,6 +17,12 @@ extern "C" FILE * __cdecl __iob_func(void) { return _iob; }
 #endif // end _MSC_VER
 
 #include <boost/asio/ssl.hpp>
+#include <boost/utility/string_ref.hpp>
+
+#include <map>
+#include <array>
+#include <algorithm>
+#include <cctype>
 
 namespace wsgi_boost
 {
@@ -25,6 +32,17 @@ namespace wsgi_boost
 	typedef boost::asio::ssl::stream<boost::asio::ip::tcp::socket> ssl_socket_t;
 	typedef std::shared_ptr<ssl_socket_t> ssl_socket_ptr;
 
+	template<>
+	struct socket_traits<ssl_socket_ptr>
+	{
+		static const bool is_tls = true;
+
+		static void set_max_record_size(ssl_socket_ptr& socket, size_t size)
+		{
+			SSL_set_max_send_fragment(socket->native_handle(), static_cast<long>(size));
+		}
+	};
+
 
 	// HTTPS server class
 	template<>
@@ -33,6 +51,34 @@ namespace wsgi_boost
 	protected:
 		boost::asio::ssl::context m_context;
 		boost::asio::ip::tcp::acceptor m_redirector;
+		SessionTicketKeys m_ticket_keys;
+
+		// Configure TLS session resumption
+		void configure_sessions()
+		{
+			SSL_CTX* ctx = m_context.native_handle();
+			const unsigned char session_id_context[] = "WsgiBoost";
+			SSL_CTX_set_session_id_context(ctx, session_id_context, sizeof(session_id_context) - 1);
+			if (session_cache_size > 0)
+			{
+				SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+				SSL_CTX_sess_set_cache_size(ctx, session_cache_size);
+			}
+			else
+			{
+				SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+			}
+			SSL_CTX_set_timeout(ctx, session_timeout);
+			if (session_tickets)
+			{
+				SSL_CTX_clear_options(ctx, SSL_OP_NO_TICKET);
+				m_ticket_keys.install(ctx, ticket_key_lifetime);
+			}
+			else
+			{
+				SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
+			}
+		}
 
 		void accept()
 		{
@@ -46,26 +92,177 @@ namespace wsgi_boost
 				if (!ec)
 				{
 					socket->lowest_layer().set_option(boost::asio::ip::tcp::no_delay(true));
-					auto timer = std::make_shared<boost::asio::deadline_timer>(*io_service);
-					timer->expires_from_now(boost::posix_time::seconds(header_timeout));
-					timer->async_wait([socket](const boost::system::error_code& ec)
-					{
-						if (ec != boost::asio::error::operation_aborted)
-						{
-							socket->lowest_layer().shutdown(boost::asio::ip::tcp::socket::shutdown_both);
-							socket->lowest_layer().close();
-						}
-					});
+					ssl_socket_ptr counted_socket = count_connection(socket);
+					// The handshake timeout is scheduled in the timer wheel of the socket's io_service
+					// that must be accessed only from its own thread.
+					io_service->post([this, counted_socket]() { handshake(counted_socket); });
+				}
+			});
+		}
+
+		void handshake(ssl_socket_ptr socket)
+		{
+			// The timeout includes waiting in the handshake queue
+			auto timeout = std::make_shared<TimerWheel::Timeout>();
+			boost::asio::use_service<TimerWheel>(get_io_service(*socket)).schedule(*timeout, header_timeout, [socket]()
+			{
+				boost::system::error_code ec;
+				socket->lowest_layer().shutdown(boost::asio::ip::tcp::socket::shutdown_both, ec);
+				socket->lowest_layer().close(ec);
+			});
+			// A handshake slot is taken only after ClientHello starts arriving,
+			// so idle connections do not hold slots
+			socket->next_layer().async_read_some(boost::asio::null_buffers(),
+				[this, socket, timeout](const boost::system::error_code& ec, size_t)
+			{
+				if (ec)
+					return;
+				HandshakeQueue& queue = boost::asio::use_service<HandshakeQueue>(get_io_service(*socket));
+				queue.start(max_handshakes, [this, socket, timeout, &queue]()
+				{
 					socket->async_handshake(boost::asio::ssl::stream_base::server,
-						[this, socket, timer](boost::system::error_code ec)
+						[this, socket, timeout, &queue](boost::system::error_code ec)
 					{
-						timer->cancel();
-						if (!ec)
+						timeout->cancel();
+						queue.done();
+						if (ec)
+							return;
+						// The 503 response to an excess connection can be sent only after the handshake
+						if (connections_exceeded())
+							shed_connection(socket);
+						else
 							process_request(socket);
 					});
+				});
+			});
+		}
+
+		// HTTP to HTTPS redirect state
+		struct Redirect
+		{
+			socket_ptr socket;
+			TimerWheel::Timeout timeout;
+			// Must hold the request line and all headers up to Host
+			std::array<char, 4096> buffer;
+			size_t length = 0;
+			std::string date;
+
+			explicit Redirect(socket_ptr sock) : socket{ sock } {}
+		};
+
+		// Pre-built parts of redirect responses
+		std::string m_redirect_head;
+		std::string m_redirect_location;
+		std::string m_redirect_port;
+		std::string m_redirect_tail;
+		std::string m_redirect_bad_request;
 
+		void build_redirect_responses()
+		{
+			m_redirect_head = "HTTP/1.1 301 Moved Permanently\r\n"
+				"Server: WsgiBoost v." WSGI_BOOST_VERSION "\r\n"
+				"Content-Length: 0\r\n"
+				"Connection: close\r\n"
+				"Date: ";
+			m_redirect_location = "\r\nLocation: https://";
+			m_redirect_port.clear();
+			if (m_port != 443)
+				m_redirect_port = ':' + std::to_string(m_port);
+			m_redirect_tail = "\r\n\r\n";
+			const std::string message = "Invalid request!";
+			m_redirect_bad_request = "HTTP/1.1 400 Bad Request\r\n"
+				"Server: WsgiBoost v." WSGI_BOOST_VERSION "\r\n"
+				"Content-Type: text/plain\r\n"
+				"Content-Length: " + std::to_string(message.length()) + "\r\n"
+				"Connection: close\r\n\r\n" + message;
+		}
+
+		// Check if a request target can be copied into Location header: no whitespace or control characters
+		static bool valid_target(boost::string_ref target)
+		{
+			for (char ch : target)
+			{
+				unsigned char c = static_cast<unsigned char>(ch);
+				if (c <= 0x20 || c == 0x7f)
+					return false;
+			}
+			return true;
+		}
+
+		// Check if a host is a RFC 3986 reg-name or IP-literal
+		static bool valid_host(boost::string_ref host)
+		{
+			const char sub_delims[] = "!$&'()*+,;=";
+			bool ip_literal = host.front() == '[';
+			if (ip_literal && (host.length() < 3 || host.back() != ']'))
+				return false;
+			if (ip_literal)
+				host = host.substr(1, host.length() - 2);
+			for (char ch : host)
+			{
+				if (std::isalnum(static_cast<unsigned char>(ch)) || ch == '-' || ch == '.' || ch == '_' || ch == '~' ||
+					std::find(sub_delims, sub_delims + sizeof(sub_delims) - 1, ch) != sub_delims + sizeof(sub_delims) - 1)
+					continue;
+				if ((ip_literal && ch == ':') || (!ip_literal && ch == '%'))
+					continue;
+				return false;
+			}
+			return true;
+		}
+
+		// Parse the request line and the Host header of a request to redirect
+		//
+		// Returns 1 if both have been found, 0 if more data are needed
+		// or -1 if the request is invalid. The port is stripped from the host.
+		// The target and the host are validated, so they can not inject headers.
+		static int parse_redirect(const char* data, size_t length, boost::string_ref& host, boost::string_ref& target)
+		{
+			const char crlf[] = "\r\n";
+			const char* end = data + length;
+			const char* line_end = std::search(data, end, crlf, crlf + 2);
+			if (line_end == end)
+				return 0;
+			// METHOD SP request-target SP HTTP-version
+			const char* target_begin = std::find(data, line_end, ' ');
+			if (target_begin == line_end || *(++target_begin) != '/')
+				return -1;
+			const char* target_end = std::find(target_begin, line_end, ' ');
+			if (target_end == line_end)
+				return -1;
+			target = boost::string_ref(target_begin, target_end - target_begin);
+			if (!valid_target(target))
+				return -1;
+			while (true)
+			{
+				const char* line_begin = line_end + 2;
+				line_end = std::search(line_begin, end, crlf, crlf + 2);
+				if (line_end == end)
+					return 0;
+				if (line_end == line_begin)
+					return -1; // No Host header
+				const char* colon = std::find(line_begin, line_end, ':');
+				if (colon - line_begin == 4 &&
+					std::equal(line_begin, colon, "host", [](char a, char b) { return std::tolower(static_cast<unsigned char>(a)) == b; }))
+				{
+					const char* host_begin = colon + 1;
+					while (host_begin < line_end && (*host_begin == ' ' || *host_begin == '\t'))
+						++host_begin;
+					const char* host_end = line_end;
+					while (host_end > host_begin && (*(host_end - 1) == ' ' || *(host_end - 1) == '\t'))
+						--host_end;
+					// Strip the port, IPv6 literals are enclosed in []
+					const char* port = host_begin < host_end && *host_begin == '[' ?
+						std::find(host_begin, host_end, ']') : host_begin;
+					port = std::find(port, host_end, ':');
+					if (port == host_begin)
+						return -1;
+					host = boost::string_ref(host_begin, port - host_begin);
+					if (!valid_host(host) || (port < host_end &&
+						!std::all_of(port + 1, host_end, [](char ch) { return ch >= '0' && ch <= '9'; })))
+						return -1;
+					return 1;
 				}
-			});
+			}
 		}
 
 		void accept_redirect()
@@ -78,45 +275,79 @@ namespace wsgi_boost
 				if (!ec)
 				{
 					socket->set_option(boost::asio::ip::tcp::no_delay(true));
-					boost::asio::spawn(socket->get_io_service(), [this, socket](boost::asio::yield_context yc)
+					// The socket's io_service may run on another thread than the acceptor,
+					// and its timer wheel must be accessed only from its own thread.
+					get_io_service(*socket).post([this, socket]()
 					{
-						Connection<socket_ptr> connection{ socket, yc, header_timeout, content_timeout };
-						Request<Connection<socket_ptr>> request{ connection };
-						Response<Connection<socket_ptr>> response{ connection };
-						parse_result res = request.parse_header();
-						if (!res)
+						auto redirect = std::make_shared<Redirect>(socket);
+						boost::asio::use_service<TimerWheel>(get_io_service(*socket)).schedule(redirect->timeout, header_timeout, [socket]()
 						{
-							std::string host = request.get_header("Host");
-							if (host.empty())
-							{
-								response.send_mesage("400 Bad Request", "'Host' header is required!");
-								return;
-							}
-							size_t pos = host.find(":");
-							if (pos != std::string::npos)
-								host = host.substr(0, pos);
-							std::string https_port;
-							if (m_port != 443)
-								https_port = ':' + std::to_string(m_port);
-							std::string location{ "https://" + host + https_port + request.path };
-							std::string message{ "Redirected to " + location };
-							response.http_version = request.http_version;
-							response.keep_alive = false;
-							out_headers_t out_headers;
-							out_headers.emplace_back("Location", location);
-							out_headers.emplace_back("Content-Length", std::to_string(message.length()));
-							out_headers.emplace_back("Content-Type", "text/plain");
-							response.send_header("301 Moved Permanently", out_headers);
-							response.send_data(message);
-						}
+							boost::system::error_code ec;
+							socket->shutdown(boost::asio::ip::tcp::socket::shutdown_both, ec);
+							socket->close(ec);
+						});
+						read_redirect(redirect);
 					});
 				}
 			});
 		}
 
+		// Read a request to redirect without a coroutine and send a response in one write
+		void read_redirect(std::shared_ptr<Redirect> redirect)
+		{
+			auto& buffer = redirect->buffer;
+			redirect->socket->async_read_some(boost::asio::buffer(&buffer[redirect->length], buffer.size() - redirect->length),
+				[this, redirect](const boost::system::error_code& ec, size_t bytes_read)
+			{
+				if (ec)
+					return;
+				redirect->length += bytes_read;
+				boost::string_ref host;
+				boost::string_ref target;
+				int result = parse_redirect(&redirect->buffer[0], redirect->length, host, target);
+				if (result == 0 && redirect->length < redirect->buffer.size())
+				{
+					read_redirect(redirect);
+					return;
+				}
+				auto close = [redirect](const boost::system::error_code&, size_t)
+				{
+					boost::system::error_code ec;
+					redirect->socket->shutdown(boost::asio::ip::tcp::socket::shutdown_both, ec);
+					redirect->socket->close(ec);
+				};
+				if (result == 1)
+				{
+					redirect->date = get_current_gmt_time();
+					std::array<boost::asio::const_buffer, 7> response = {
+						boost::asio::buffer(m_redirect_head),
+						boost::asio::buffer(redirect->date),
+						boost::asio::buffer(m_redirect_location),
+						boost::asio::buffer(host.data(), host.length()),
+						boost::asio::buffer(m_redirect_port),
+						boost::asio::buffer(target.data(), target.length()),
+						boost::asio::buffer(m_redirect_tail)
+					};
+					boost::asio::async_write(*redirect->socket, response, close);
+				}
+				else
+				{
+					boost::asio::async_write(*redirect->socket, boost::asio::buffer(m_redirect_bad_request), close);
+				}
+			});
+		}
+
 	public:
 		bool redirect_http = false;
 		unsigned short redirect_http_port = 80;
+		unsigned int max_handshakes = 0;
+		std::string ciphers = default_ciphers;
+		std::string curves = default_curves;
+		std::string min_tls_version = "TLSv1.2";
+		unsigned int session_cache_size = 20480;
+		unsigned int session_timeout = 300;
+		bool session_tickets = true;
+		unsigned int ticket_key_lifetime = 3600;
 
 		HttpsServer(std::string cert_chain, const std::string private_key, std::string dh = std::string(),
 			std::string address = std::string(), unsigned short port = 4443, unsigned int threads = 0) :
@@ -145,10 +376,19 @@ namespace wsgi_boost
 
 		void start()
 		{
-			if (!is_running() && redirect_http)
+			if (!is_running())
 			{
-				init_acceptor(m_redirector, redirect_http_port);
-				accept_redirect();
+				SSL_CTX* ctx = m_context.native_handle();
+				set_ciphers(ctx, ciphers);
+				set_curves(ctx, curves);
+				set_min_tls_version(ctx, min_tls_version);
+				configure_sessions();
+				if (redirect_http)
+				{
+					build_redirect_responses();
+					init_acceptor(m_redirector, redirect_http_port);
+					accept_redirect();
+				}
 			}
 			BaseServer<ssl_socket_ptr>::start();
 		}
@@ -159,6 +399,23 @@ namespace wsgi_boost
 				m_redirector.close();
 			BaseServer<ssl_socket_ptr>::stop();
 		}
+
+		// Get TLS session resumption statistics
+		std::map<std::string, long long> session_stats()
+		{
+			SSL_CTX* ctx = m_context.native_handle();
+			std::map<std::string, long long> stats;
+			stats["accepts"] = SSL_CTX_sess_accept(ctx);
+			stats["hits"] = SSL_CTX_sess_hits(ctx);
+			stats["misses"] = SSL_CTX_sess_misses(ctx);
+			stats["timeouts"] = SSL_CTX_sess_timeouts(ctx);
+			stats["cache_full"] = SSL_CTX_sess_cache_full(ctx);
+			stats["cached_sessions"] = SSL_CTX_sess_number(ctx);
+			stats["tickets_issued"] = m_ticket_keys.issued_tickets.load();
+			stats["tickets_resumed"] = m_ticket_keys.resumed_tickets.load();
+			stats["tickets_unknown_key"] = m_ticket_keys.unknown_key_tickets.load();
+			return stats;
+		}
 	};
 }
 #endif // HTTPS_ENABLED
@@ -0,0 +1,169 @@
+#pragma once
+/*
+Timing wheel for connection timeouts
+
+Copyright (c) 2017 Roman Miroshnychenko <romanvm@yandex.ua>
+License: MIT, see License.txt
+*/
+
+#include "asio_service.h"
+
+#include <boost/asio.hpp>
+
+#include <functional>
+#include <vector>
+#include <algorithm>
+
+
+namespace wsgi_boost
+{
+	// Hashed timing wheel with 1s resolution
+	//
+	// A wheel is attached to each io_service as an Asio service
+	// and must be used only from the thread that runs its io_service.
+	// Scheduling and cancelling a timeout take O(1) time,
+	// and all timeouts that expire on the same tick are handled in one batch.
+	// Unlike deadline_timer, a timeout handler is called only on expiration.
+	class TimerWheel : public AsioService<TimerWheel>
+	{
+	public:
+		// A timeout that is linked into a wheel slot while pending
+		class Timeout
+		{
+			friend class TimerWheel;
+
+		private:
+			TimerWheel* m_wheel = nullptr;
+			Timeout* m_prev = nullptr;
+			Timeout* m_next = nullptr;
+			size_t m_slot = 0;
+			size_t m_rounds = 0;
+			std::function<void()> m_handler;
+
+		public:
+			Timeout() {}
+
+			Timeout(const Timeout&) = delete;
+			Timeout& operator=(const Timeout&) = delete;
+
+			~Timeout() { cancel(); }
+
+			// Cancel the timeout if it is pending
+			void cancel()
+			{
+				if (m_wheel)
+					m_wheel->unlink(*this);
+			}
+		};
+
+	private:
+		static const size_t wheel_size = 512;
+
+		std::vector<Timeout*> m_slots;
+		size_t m_current = 0;
+		size_t m_pending = 0;
+		bool m_ticking = false;
+		boost::asio::deadline_timer m_tick_timer;
+
+		void link(Timeout& timeout, size_t slot)
+		{
+			timeout.m_wheel = this;
+			timeout.m_slot = slot;
+			timeout.m_prev = nullptr;
+			timeout.m_next = m_slots[slot];
+			if (m_slots[slot])
+				m_slots[slot]->m_prev = &timeout;
+			m_slots[slot] = &timeout;
+			++m_pending;
+		}
+
+		void unlink(Timeout& timeout)
+		{
+			if (timeout.m_prev)
+				timeout.m_prev->m_next = timeout.m_next;
+			else
+				m_slots[timeout.m_slot] = timeout.m_next;
+			if (timeout.m_next)
+				timeout.m_next->m_prev = timeout.m_prev;
+			timeout.m_wheel = nullptr;
+			timeout.m_prev = nullptr;
+			timeout.m_next = nullptr;
+			--m_pending;
+		}
+
+		void wait_tick()
+		{
+			m_tick_timer.async_wait([this](const boost::system::error_code& ec)
+			{
+				if (ec == boost::asio::error::operation_aborted)
+				{
+					m_ticking = false;
+					return;
+				}
+				tick();
+			});
+		}
+
+		void tick()
+		{
+			m_current = (m_current + 1) % wheel_size;
+			// Handlers are called after the slot has been processed
+			// because they may schedule or cancel other timeouts.
+			std::vector<std::function<void()>> expired;
+			Timeout* timeout = m_slots[m_current];
+			while (timeout)
+			{
+				Timeout* next = timeout->m_next;
+				if (timeout->m_rounds == 0)
+				{
+					expired.emplace_back(std::move(timeout->m_handler));
+					unlink(*timeout);
+				}
+				else
+				{
+					--timeout->m_rounds;
+				}
+				timeout = next;
+			}
+			for (auto& handler : expired)
+				handler();
+			if (m_pending > 0)
+			{
+				m_tick_timer.expires_at(m_tick_timer.expires_at() + boost::posix_time::seconds(1));
+				wait_tick();
+			}
+			else
+			{
+				m_ticking = false;
+			}
+		}
+
+	public:
+		explicit TimerWheel(boost::asio::io_service& io_service) :
+			AsioService<TimerWheel>(io_service),
+			m_slots(wheel_size, nullptr), m_tick_timer{ io_service } {}
+
+		void shutdown_service()
+		{
+			boost::system::error_code ec;
+			m_tick_timer.cancel(ec);
+		}
+
+		// Schedule a timeout in seconds. A pending timeout is re-scheduled.
+		void schedule(Timeout& timeout, unsigned int seconds, std::function<void()> handler)
+		{
+			timeout.cancel();
+			// The first tick of a running wheel happens in less than 1s
+			size_t ticks = std::max<size_t>(m_ticking ? seconds + 1 : seconds, 1);
+			timeout.m_rounds = (ticks - 1) / wheel_size;
+			timeout.m_handler = std::move(handler);
+			link(timeout, (m_current + ticks) % wheel_size);
+			if (!m_ticking)
+			{
+				m_ticking = true;
+				m_tick_timer.expires_from_now(boost::posix_time::seconds(1));
+				wait_tick();
+			}
+		}
+	};
+}
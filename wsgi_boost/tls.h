@@ -0,0 +1,316 @@
+#pragma once
+/*
+TLS utilities for HTTPS server
+
+Copyright (c) 2017 Roman Miroshnychenko <romanvm@yandex.ua>
+License: MIT, see License.txt
+*/
+#ifdef HTTPS_ENABLED
+
+#include "asio_service.h"
+
+#include <boost/asio/ssl.hpp>
+#include <openssl/ssl.h>
+#include <openssl/rand.h>
+#include <openssl/evp.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#else
+#include <openssl/hmac.h>
+#endif
+
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <ctime>
+#include <cstring>
+#include <string>
+#include <stdexcept>
+
+
+namespace wsgi_boost
+{
+	// ECDHE key exchange with forward secrecy only, ECDSA certificates are preferred
+	const std::string default_ciphers =
+		"ECDHE-ECDSA-AES128-GCM-SHA256:ECDHE-RSA-AES128-GCM-SHA256:"
+		"ECDHE-ECDSA-CHACHA20-POLY1305:ECDHE-RSA-CHACHA20-POLY1305:"
+		"ECDHE-ECDSA-AES256-GCM-SHA384:ECDHE-RSA-AES256-GCM-SHA384:"
+		"ECDHE-ECDSA-AES128-SHA256:ECDHE-RSA-AES128-SHA256";
+
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+	const std::string default_curves = "X25519:P-256:P-384";
+#else
+	const std::string default_curves = "P-256:P-384";
+#endif
+
+	// Set the list of TLS 1.2 and below ciphers in OpenSSL format
+	inline void set_ciphers(SSL_CTX* ctx, const std::string& ciphers)
+	{
+		if (SSL_CTX_set_cipher_list(ctx, ciphers.c_str()) != 1)
+			throw std::invalid_argument("Invalid cipher list: " + ciphers);
+		SSL_CTX_set_options(ctx, SSL_OP_CIPHER_SERVER_PREFERENCE);
+	}
+
+	// Set the list of elliptic curves for ECDHE key exchange, e.g. "X25519:P-256"
+	inline void set_curves(SSL_CTX* ctx, const std::string& curves)
+	{
+#if OPENSSL_VERSION_NUMBER >= 0x10002000L
+		if (SSL_CTX_set1_curves_list(ctx, curves.c_str()) != 1)
+			throw std::invalid_argument("Invalid curves list: " + curves);
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+		SSL_CTX_set_ecdh_auto(ctx, 1);
+#endif
+#else
+		throw std::runtime_error("Setting curves requires OpenSSL 1.0.2 or above!");
+#endif
+	}
+
+	// Set the min. TLS protocol version: "TLSv1", "TLSv1.1", "TLSv1.2" or "TLSv1.3"
+	inline void set_min_tls_version(SSL_CTX* ctx, const std::string& version)
+	{
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+		int proto_version;
+		if (version == "TLSv1")
+			proto_version = TLS1_VERSION;
+		else if (version == "TLSv1.1")
+			proto_version = TLS1_1_VERSION;
+		else if (version == "TLSv1.2")
+			proto_version = TLS1_2_VERSION;
+#ifdef TLS1_3_VERSION
+		else if (version == "TLSv1.3")
+			proto_version = TLS1_3_VERSION;
+#endif
+		else
+			throw std::invalid_argument("Invalid TLS version: " + version);
+		SSL_CTX_set_min_proto_version(ctx, proto_version);
+#else
+		long options;
+		if (version == "TLSv1")
+			options = 0;
+		else if (version == "TLSv1.1")
+			options = SSL_OP_NO_TLSv1;
+		else if (version == "TLSv1.2")
+			options = SSL_OP_NO_TLSv1 | SSL_OP_NO_TLSv1_1;
+		else
+			throw std::invalid_argument("Invalid TLS version: " + version);
+		SSL_CTX_clear_options(ctx, SSL_OP_NO_TLSv1 | SSL_OP_NO_TLSv1_1);
+		SSL_CTX_set_options(ctx, options);
+#endif
+	}
+
+	// In-memory session ticket keys that are rotated periodically
+	//
+	// New tickets are encrypted with the current key. Tickets encrypted with
+	// the previous key are still accepted and renewed, so a ticket stays valid
+	// for at least one rotation interval.
+	class SessionTicketKeys
+	{
+	private:
+		struct Key
+		{
+			unsigned char name[16];
+			unsigned char aes_key[32];
+			unsigned char hmac_key[32];
+			time_t created = 0;
+		};
+
+		// Boost.Asio keeps its verify callback in SSL_CTX app data,
+		// so a separate ex data index is used for the keys
+		static int ex_data_index()
+		{
+			static const int index = SSL_CTX_get_ex_new_index(0, nullptr, nullptr, nullptr, nullptr);
+			return index;
+		}
+
+		Key m_current;
+		Key m_previous;
+		std::mutex m_mutex;
+		unsigned int m_lifetime = 3600;
+
+		void generate(Key& key)
+		{
+			if (RAND_bytes(key.name, sizeof(key.name)) != 1 ||
+				RAND_bytes(key.aes_key, sizeof(key.aes_key)) != 1 ||
+				RAND_bytes(key.hmac_key, sizeof(key.hmac_key)) != 1)
+			{
+				throw std::runtime_error("Unable to generate a session ticket key!");
+			}
+			key.created = std::time(nullptr);
+		}
+
+		// Get a copy of a key by name or of the current key if name is nullptr,
+		// rotating the keys if needed
+		bool find_key(const unsigned char* name, Key& key, bool& is_current)
+		{
+			std::lock_guard<std::mutex> lock{ m_mutex };
+			time_t now = std::time(nullptr);
+			if (now - m_current.created >= static_cast<time_t>(m_lifetime))
+			{
+				m_previous = m_current;
+				generate(m_current);
+			}
+			if (!name || std::memcmp(name, m_current.name, sizeof(m_current.name)) == 0)
+			{
+				key = m_current;
+				is_current = true;
+				return true;
+			}
+			if (m_previous.created > 0 && std::memcmp(name, m_previous.name, sizeof(m_previous.name)) == 0)
+			{
+				key = m_previous;
+				is_current = false;
+				return true;
+			}
+			return false;
+		}
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+		typedef EVP_MAC_CTX hmac_ctx_t;
+
+		static bool init_hmac(hmac_ctx_t* hctx, unsigned char* key, size_t key_len)
+		{
+			char digest[] = "SHA256";
+			OSSL_PARAM params[] = {
+				OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, digest, 0),
+				OSSL_PARAM_construct_end()
+			};
+			return EVP_MAC_init(hctx, key, key_len, params) == 1;
+		}
+#else
+		typedef HMAC_CTX hmac_ctx_t;
+
+		static bool init_hmac(hmac_ctx_t* hctx, unsigned char* key, size_t key_len)
+		{
+			return HMAC_Init_ex(hctx, key, static_cast<int>(key_len), EVP_sha256(), nullptr) == 1;
+		}
+#endif
+
+		// OpenSSL session ticket key callback
+		static int ticket_key_callback(SSL* ssl, unsigned char* key_name, unsigned char* iv,
+			EVP_CIPHER_CTX* ctx, hmac_ctx_t* hctx, int enc)
+		{
+			auto keys = static_cast<SessionTicketKeys*>(SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), ex_data_index()));
+			Key key;
+			bool is_current;
+			try
+			{
+				if (!keys->find_key(enc ? nullptr : key_name, key, is_current))
+				{
+					++keys->unknown_key_tickets;
+					return 0; // Do a full handshake and issue a new ticket
+				}
+			}
+			catch (const std::runtime_error&)
+			{
+				return -1;
+			}
+			if (enc)
+			{
+				std::memcpy(key_name, key.name, sizeof(key.name));
+				if (RAND_bytes(iv, EVP_MAX_IV_LENGTH) != 1 ||
+					EVP_EncryptInit_ex(ctx, EVP_aes_256_cbc(), nullptr, key.aes_key, iv) != 1 ||
+					!init_hmac(hctx, key.hmac_key, sizeof(key.hmac_key)))
+				{
+					return -1;
+				}
+				++keys->issued_tickets;
+				return 1;
+			}
+			if (!init_hmac(hctx, key.hmac_key, sizeof(key.hmac_key)) ||
+				EVP_DecryptInit_ex(ctx, EVP_aes_256_cbc(), nullptr, key.aes_key, iv) != 1)
+			{
+				return -1;
+			}
+			++keys->resumed_tickets;
+			// Renew tickets encrypted with the previous key
+			return is_current ? 1 : 2;
+		}
+
+	public:
+		std::atomic<unsigned long long> issued_tickets;
+		std::atomic<unsigned long long> resumed_tickets;
+		std::atomic<unsigned long long> unknown_key_tickets;
+
+		SessionTicketKeys()
+		{
+			issued_tickets.store(0);
+			resumed_tickets.store(0);
+			unknown_key_tickets.store(0);
+		}
+
+		SessionTicketKeys(const SessionTicketKeys&) = delete;
+		SessionTicketKeys& operator=(const SessionTicketKeys&) = delete;
+
+		// Generate a new current key and set ticket callback for an SSL context
+		void install(SSL_CTX* ctx, unsigned int lifetime)
+		{
+			{
+				std::lock_guard<std::mutex> lock{ m_mutex };
+				m_lifetime = lifetime;
+				generate(m_current);
+				m_previous.created = 0;
+			}
+			SSL_CTX_set_ex_data(ctx, ex_data_index(), this);
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+			SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, &SessionTicketKeys::ticket_key_callback);
+#else
+			SSL_CTX_set_tlsext_ticket_key_cb(ctx, &SessionTicketKeys::ticket_key_callback);
+#endif
+		}
+	};
+
+
+	// Limits the number of concurrent TLS handshakes on an io_service
+	//
+	// Handshakes are CPU-heavy and run on the same thread as requests of established connections,
+	// so a burst of new connections can starve those requests. Excess handshakes wait in a FIFO
+	// queue, and a queued handshake is posted to the io_service to let other handlers run first.
+	// A queue is attached to each io_service as an Asio service and must be used only
+	// from the thread that runs its io_service.
+	class HandshakeQueue : public AsioService<HandshakeQueue>
+	{
+	private:
+		boost::asio::io_service& m_io_service;
+		std::deque<std::function<void()>> m_queue;
+		unsigned int m_running = 0;
+
+	public:
+		explicit HandshakeQueue(boost::asio::io_service& io_service) :
+			AsioService<HandshakeQueue>(io_service), m_io_service(io_service) {}
+
+		void shutdown_service() { m_queue.clear(); }
+
+		// Start a handshake now or queue it if limit handshakes are already running (0 - no limit)
+		//
+		// The handshake must call done() on completion.
+		void start(unsigned int limit, std::function<void()> handshake)
+		{
+			if (limit == 0 || m_running < limit)
+			{
+				++m_running;
+				handshake();
+			}
+			else
+			{
+				m_queue.push_back(std::move(handshake));
+			}
+		}
+
+		// Notify that a handshake has completed and start the next queued one
+		void done()
+		{
+			--m_running;
+			if (!m_queue.empty())
+			{
+				++m_running;
+				m_io_service.post(std::move(m_queue.front()));
+				m_queue.pop_front();
+			}
+		}
+
+		// Get the number of queued handshakes
+		size_t queued() const { return m_queue.size(); }
+	};
+}
+#endif // HTTPS_ENABLED
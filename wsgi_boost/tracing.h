@@ -0,0 +1,294 @@
+#pragma once
+/*
+Request tracing
+
+Copyright (c) 2017 Roman Miroshnychenko <romanvm@yandex.ua>
+License: MIT, see License.txt
+*/
+
+#include <pybind11/pybind11.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <vector>
+#include <string>
+#include <fstream>
+#include <cstring>
+#include <cstdio>
+#include <stdexcept>
+
+
+namespace wsgi_boost
+{
+	// Request processing phase boundaries in the order they are reached
+	enum TracePhase
+	{
+		TRACE_START,        // Started reading a request header
+		TRACE_HEADER_READ,  // The header has been received and parsed
+		TRACE_GIL_WAIT,     // Started waiting for the GIL (WSGI requests only)
+		TRACE_APP_START,    // The GIL has been acquired and the WSGI app is called
+		TRACE_APP_RETURNED, // The WSGI app has returned a response iterable
+		TRACE_FIRST_BYTE,   // The first part of the response has been sent
+		TRACE_END,          // The response has been sent completely
+		TRACE_PHASE_COUNT
+	};
+
+	const char* const trace_phase_names[TRACE_PHASE_COUNT] = {
+		"start", "header_read", "gil_wait", "app_start", "app_returned", "first_byte", "end"
+	};
+
+	// Names of the intervals that end at each phase for Chrome trace
+	const char* const trace_interval_names[TRACE_PHASE_COUNT] = {
+		"", "read_header", "prepare", "wait_gil", "app", "first_byte", "respond"
+	};
+
+	// Monotonic time in nanoseconds, the same clock as Python time.monotonic_ns() on Linux
+	inline long long trace_clock()
+	{
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	// Small sequential number of the current thread
+	inline unsigned int trace_thread_id()
+	{
+		static std::atomic<unsigned int> counter{ 0 };
+		thread_local unsigned int id = ++counter;
+		return id;
+	}
+
+
+	// Phase timestamps of a request being processed
+	class RequestTrace
+	{
+	private:
+		bool m_enabled = false;
+		long long m_timestamps[TRACE_PHASE_COUNT];
+
+	public:
+		// Start a trace if tracing is enabled
+		void start(bool enabled)
+		{
+			m_enabled = enabled;
+			if (m_enabled)
+			{
+				std::fill(m_timestamps, m_timestamps + TRACE_PHASE_COUNT, 0LL);
+				m_timestamps[TRACE_START] = trace_clock();
+			}
+		}
+
+		void mark(TracePhase phase)
+		{
+			if (m_enabled)
+				m_timestamps[phase] = trace_clock();
+		}
+
+		// Mark a phase only the first time it is reached
+		void mark_once(TracePhase phase)
+		{
+			if (m_enabled && m_timestamps[phase] == 0)
+				m_timestamps[phase] = trace_clock();
+		}
+
+		bool enabled() const { return m_enabled; }
+
+		const long long* timestamps() const { return m_timestamps; }
+	};
+
+
+	// Lock-free ring buffer of completed request traces
+	//
+	// Writers claim slots with an atomic counter and publish records with a per-slot
+	// sequence number (a seqlock), so request processing never blocks on a reader.
+	// The oldest records are overwritten when the buffer is full.
+	class Tracer
+	{
+	private:
+		struct Record
+		{
+			unsigned long long id;
+			unsigned int thread;
+			char method[8];
+			char path[108];
+			long long timestamps[TRACE_PHASE_COUNT];
+		};
+
+		struct Slot
+		{
+			std::atomic<unsigned long long> seq;
+			Record record;
+		};
+
+		std::vector<Slot> m_slots;
+		size_t m_mask = 0;
+		std::atomic<unsigned long long> m_head;
+		std::atomic_bool m_enabled;
+
+		static void copy_string(char* dest, size_t size, const std::string& src)
+		{
+			size_t length = std::min(src.length(), size - 1);
+			std::memcpy(dest, src.data(), length);
+			dest[length] = '\0';
+		}
+
+		static std::string json_escape(const char* str)
+		{
+			std::string escaped;
+			for (; *str; ++str)
+			{
+				unsigned char ch = static_cast<unsigned char>(*str);
+				if (ch == '"' || ch == '\\')
+				{
+					escaped += '\\';
+					escaped += static_cast<char>(ch);
+				}
+				else if (ch < 0x20)
+				{
+					char buffer[8];
+					std::snprintf(buffer, sizeof(buffer), "\\u%04x", ch);
+					escaped += buffer;
+				}
+				else
+				{
+					escaped += static_cast<char>(ch);
+				}
+			}
+			return escaped;
+		}
+
+		// Get a consistent copy of completed records, oldest first
+		std::vector<Record> snapshot() const
+		{
+			std::vector<Record> records;
+			unsigned long long head = m_head.load(std::memory_order_acquire);
+			unsigned long long first = head > m_slots.size() ? head - m_slots.size() : 0;
+			for (unsigned long long ticket = first; ticket < head; ++ticket)
+			{
+				const Slot& slot = m_slots[ticket & m_mask];
+				unsigned long long seq = slot.seq.load(std::memory_order_acquire);
+				if (seq != 2 * ticket + 2)
+					continue; // Not published yet or already overwritten
+				Record record = slot.record;
+				std::atomic_thread_fence(std::memory_order_acquire);
+				if (slot.seq.load(std::memory_order_relaxed) == seq && record.id == ticket)
+					records.push_back(record);
+			}
+			return records;
+		}
+
+	public:
+		explicit Tracer(size_t capacity = 4096)
+		{
+			m_head.store(0);
+			m_enabled.store(false);
+			resize(capacity);
+		}
+
+		Tracer(const Tracer&) = delete;
+		Tracer& operator=(const Tracer&) = delete;
+
+		// Set the buffer capacity rounded up to a power of 2 and drop all records.
+		// Must not be called while requests are being traced.
+		void resize(size_t capacity)
+		{
+			size_t size = 1;
+			while (size < capacity)
+				size <<= 1;
+			std::vector<Slot> slots(size);
+			for (auto& slot : slots)
+				slot.seq.store(0);
+			m_slots.swap(slots);
+			m_mask = size - 1;
+			m_head.store(0);
+		}
+
+		bool enabled() const { return m_enabled.load(std::memory_order_relaxed); }
+
+		void enable(bool enabled) { m_enabled.store(enabled); }
+
+		size_t capacity() const { return m_slots.size(); }
+
+		// Save a completed request trace
+		void add(const std::string& method, const std::string& path, const RequestTrace& trace)
+		{
+			if (!trace.enabled())
+				return;
+			unsigned long long ticket = m_head.fetch_add(1, std::memory_order_relaxed);
+			Slot& slot = m_slots[ticket & m_mask];
+			slot.seq.store(2 * ticket + 1, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_release);
+			Record& record = slot.record;
+			record.id = ticket;
+			record.thread = trace_thread_id();
+			copy_string(record.method, sizeof(record.method), method);
+			copy_string(record.path, sizeof(record.path), path);
+			std::memcpy(record.timestamps, trace.timestamps(), sizeof(record.timestamps));
+			slot.seq.store(2 * ticket + 2, std::memory_order_release);
+		}
+
+		// Get traces as a list of dicts with phase timestamps in nanoseconds (None if not reached)
+		pybind11::list get_traces() const
+		{
+			pybind11::list traces;
+			for (const auto& record : snapshot())
+			{
+				pybind11::dict trace;
+				trace["id"] = record.id;
+				trace["thread"] = record.thread;
+				trace["method"] = std::string{ record.method };
+				trace["path"] = std::string{ record.path };
+				for (size_t i = 0; i < TRACE_PHASE_COUNT; ++i)
+				{
+					if (record.timestamps[i])
+						trace[trace_phase_names[i]] = record.timestamps[i];
+					else
+						trace[trace_phase_names[i]] = pybind11::none();
+				}
+				traces.append(trace);
+			}
+			return traces;
+		}
+
+		// Write traces to a file in Chrome trace event format (chrome://tracing)
+		void dump_chrome_trace(const std::string& filename) const
+		{
+			std::ofstream ofs{ filename };
+			if (!ofs)
+				throw std::runtime_error("Unable to open file " + filename + " for writing!");
+			ofs << "{\"traceEvents\":[";
+			bool first = true;
+			auto write_event = [&ofs, &first](const Record& record, const char* name, long long begin, long long end, bool with_args)
+			{
+				if (!first)
+					ofs << ",\n";
+				first = false;
+				ofs << "{\"name\":\"" << name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << record.thread
+					<< ",\"ts\":" << begin / 1000 << '.' << begin % 1000 / 100
+					<< ",\"dur\":" << (end - begin) / 1000 << '.' << (end - begin) % 1000 / 100;
+				if (with_args)
+				{
+					ofs << ",\"args\":{\"id\":" << record.id << ",\"method\":\"" << json_escape(record.method)
+						<< "\",\"path\":\"" << json_escape(record.path) << "\"}";
+				}
+				ofs << '}';
+			};
+			for (const auto& record : snapshot())
+			{
+				const long long* ts = record.timestamps;
+				if (!ts[TRACE_END])
+					continue;
+				write_event(record, "request", ts[TRACE_START], ts[TRACE_END], true);
+				size_t previous = TRACE_START;
+				for (size_t i = TRACE_HEADER_READ; i < TRACE_PHASE_COUNT; ++i)
+				{
+					if (!ts[i])
+						continue;
+					write_event(record, trace_interval_names[i], ts[previous], ts[i], false);
+					previous = i;
+				}
+			}
+			ofs << "]}\n";
+		}
+	};
+}
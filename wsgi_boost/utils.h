@@ -11,15 +11,21 @@ License: MIT, see License.txt
 #include <pybind11/pybind11.h>
 #include <pybind11/stl.h>
 #include <boost/algorithm/string.hpp>
-#include <boost/regex.hpp>
 
 #include <string>
+#include <vector>
+#include <algorithm>
+#include <atomic>
 #include <sstream>
 #include <ctime>
 #include <iomanip>
 #include <cctype>
 #include <iostream>
 
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 namespace wsgi_boost
 {
@@ -63,6 +69,21 @@ namespace wsgi_boost
 	}
 
 
+	// Get Date header line with current GMT time, cached for one second per thread
+	inline const std::string& date_header()
+	{
+		thread_local time_t cached_time = 0;
+		thread_local std::string cached_header;
+		time_t now = std::time(nullptr);
+		if (now != cached_time)
+		{
+			cached_header = "Date: " + time_to_header(now) + "\r\n";
+			cached_time = now;
+		}
+		return cached_header;
+	}
+
+
 	// Splits a full path into a path proper and a query string
 	inline std::pair<std::string, std::string> split_path(const std::string& path)
 	{
@@ -86,23 +107,149 @@ namespace wsgi_boost
 	}
 
 
-	// Parse Range header
-	inline std::pair<std::string, std::string> parse_range(std::string& requested_range)
+	// Check if an If-None-Match header value matches an ETag using weak comparison
+	inline bool etag_matches(const std::string& header, const std::string& etag)
 	{
-		std::pair<std::string, std::string> range;
-		boost::regex range_regex{ "^bytes=(\\d*)-(\\d*)$" };
-		boost::smatch range_match;
-		boost::regex_search(requested_range, range_match, range_regex);
-		if (!range_match.empty())
+		size_t pos = 0;
+		while (pos < header.length())
 		{
-			if (range_match[1].first != requested_range.end())
-				range.first = std::string{ range_match[1].first, range_match[1].second };
-			if (range_match[2].first != requested_range.end())
-				range.second = std::string{ range_match[2].first, range_match[2].second };
+			size_t end = header.find(',', pos);
+			if (end == std::string::npos)
+				end = header.length();
+			while (pos < end && (header[pos] == ' ' || header[pos] == '\t'))
+				++pos;
+			size_t last = end;
+			while (last > pos && (header[last - 1] == ' ' || header[last - 1] == '\t'))
+				--last;
+			if (header.compare(pos, 2, "W/") == 0)
+				pos += 2;
+			if (header.compare(pos, last - pos, "*") == 0 || header.compare(pos, last - pos, etag) == 0)
+				return true;
+			pos = end + 1;
 		}
-		return range;
+		return false;
 	}
-	
+
+	// A byte range with inclusive bounds
+	struct ByteRange
+	{
+		size_t first;
+		size_t last;
+	};
+
+	// Parse a Range header value (RFC 7233) for content of the given length
+	//
+	// Returns false if the header is malformed, has too many ranges or other units than bytes,
+	// so it must be ignored. Otherwise ranges contains satisfiable ranges clamped to the content,
+	// and an empty list means that no range can be satisfied. Overlapping ranges are merged.
+	inline bool parse_range(const std::string& header, size_t length, std::vector<ByteRange>& ranges)
+	{
+		const size_t max_ranges = 64;
+		ranges.clear();
+		if (header.compare(0, 6, "bytes=") != 0)
+			return false;
+		const char* pos = header.c_str() + 6;
+		const char* end = header.c_str() + header.length();
+		auto skip_spaces = [&pos, end]()
+		{
+			while (pos < end && (*pos == ' ' || *pos == '\t'))
+				++pos;
+		};
+		auto parse_number = [&pos, end](size_t& number) -> bool
+		{
+			const char* start = pos;
+			number = 0;
+			for (; pos < end && *pos >= '0' && *pos <= '9'; ++pos)
+			{
+				size_t digit = *pos - '0';
+				if (number > (static_cast<size_t>(-1) - digit) / 10)
+					return false;
+				number = number * 10 + digit;
+			}
+			return pos > start;
+		};
+		size_t spec_count = 0;
+		bool overlap = false;
+		while (true)
+		{
+			skip_spaces();
+			if (pos < end && *pos == ',')
+			{
+				// Empty list elements are allowed
+				++pos;
+				continue;
+			}
+			if (pos == end)
+				break;
+			if (++spec_count > max_ranges)
+				return false;
+			size_t first;
+			size_t last;
+			if (*pos == '-')
+			{
+				// Suffix range: the last N bytes
+				++pos;
+				size_t suffix;
+				if (!parse_number(suffix))
+					return false;
+				if (suffix > 0 && length > 0)
+				{
+					first = suffix < length ? length - suffix : 0;
+					last = length - 1;
+				}
+				else
+				{
+					first = length; // Not satisfiable
+				}
+			}
+			else
+			{
+				if (!parse_number(first) || pos == end || *pos != '-')
+					return false;
+				++pos;
+				if (parse_number(last))
+				{
+					if (last < first)
+						return false;
+					if (length > 0 && last >= length)
+						last = length - 1;
+				}
+				else
+				{
+					last = length - 1;
+				}
+			}
+			if (first < length)
+			{
+				for (const auto& range : ranges)
+				{
+					if (first <= range.last + 1 && range.first <= last + 1)
+						overlap = true;
+				}
+				ranges.push_back(ByteRange{ first, last });
+			}
+			skip_spaces();
+			if (pos < end && *pos != ',')
+				return false;
+		}
+		if (spec_count == 0)
+			return false;
+		if (overlap)
+		{
+			std::sort(ranges.begin(), ranges.end(), [](const ByteRange& a, const ByteRange& b) { return a.first < b.first; });
+			size_t merged = 0;
+			for (size_t i = 1; i < ranges.size(); ++i)
+			{
+				if (ranges[i].first <= ranges[merged].last + 1)
+					ranges[merged].last = std::max(ranges[merged].last, ranges[i].last);
+				else
+					ranges[++merged] = ranges[i];
+			}
+			ranges.resize(merged + 1);
+		}
+		return true;
+	}
+
 	// Get hexadecimal representation of an unisigned int number
 	inline std::string hex(size_t u_int)
 	{
@@ -133,6 +280,25 @@ namespace wsgi_boost
 				return "application/octet-stream";
 			return it->second;
 	}
+
+
+	// Fill %1%, %2% and %3% placeholders of html_template
+	inline std::string render_html(const std::string& title, const std::string& header, const std::string& text)
+	{
+		const std::string* args[] = { &title, &header, &text };
+		std::string html;
+		html.reserve(html_template.length() + title.length() + header.length() + text.length());
+		size_t pos = 0;
+		size_t found;
+		while ((found = html_template.find('%', pos)) != std::string::npos && found + 2 < html_template.length())
+		{
+			html.append(html_template, pos, found - pos);
+			html += *args[html_template[found + 1] - '1'];
+			pos = found + 3;
+		}
+		html.append(html_template, pos, std::string::npos);
+		return html;
+	}
 #pragma endregion
 
 #pragma region classes
@@ -159,6 +325,52 @@ namespace wsgi_boost
 	};
 
 
+	// Increments an atomic counter for the lifetime of the object
+	template <class T>
+	class ScopedCounter
+	{
+	private:
+		std::atomic<T>& m_counter;
+		T m_value;
+
+	public:
+		explicit ScopedCounter(std::atomic<T>& counter) : m_counter{ counter } { m_value = ++m_counter; }
+
+		~ScopedCounter() { --m_counter; }
+
+		ScopedCounter(const ScopedCounter&) = delete;
+		ScopedCounter& operator=(const ScopedCounter&) = delete;
+
+		// Get the counter value right after incrementing
+		T value() const { return m_value; }
+	};
+
+
+#ifdef __linux__
+	// Owns a read-only POSIX file descriptor
+	class FileDescriptor
+	{
+	private:
+		int m_fd;
+
+	public:
+		explicit FileDescriptor(const std::string& path) : m_fd{ ::open(path.c_str(), O_RDONLY | O_CLOEXEC) } {}
+
+		~FileDescriptor()
+		{
+			if (m_fd >= 0)
+				::close(m_fd);
+		}
+
+		FileDescriptor(const FileDescriptor&) = delete;
+		FileDescriptor& operator=(const FileDescriptor&) = delete;
+
+		// Get the descriptor or -1 if the file could not be opened
+		int get() const { return m_fd; }
+	};
+#endif
+
+
 	// wsgi.errors stream implementation
 	struct ErrorStream
 	{
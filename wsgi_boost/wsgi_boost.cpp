@@ -24,6 +24,7 @@ PYBIND11_PLUGIN(wsgi_boost)
 	module.attr("__author__") = "Roman Miroshnychenko";
 	module.attr("__email__") = "romanvm@yandex.ua";
 	module.attr("__license__") = "MIT";
+	module.attr("io_backend") = io_backend();
 	py::list all;
 
 
@@ -71,6 +72,52 @@ PYBIND11_PLUGIN(wsgi_boost)
 			py::arg("address") = string(), py::arg("port") = 8000, py::arg("threads") = 0)
 		.def_property_readonly("is_running", &HttpServer<socket_ptr>::is_running, "Get server running status")
 		.def_readwrite("use_gzip", &HttpServer<socket_ptr>::use_gzip, "Use gzip compression for static content, default: ``True``")
+		.def_readwrite("use_sendfile", &HttpServer<socket_ptr>::use_sendfile,
+			"Send uncompressed static files with zero-copy ``sendfile()`` (Linux only), default: ``True``")
+		.def_readwrite("content_etags", &HttpServer<socket_ptr>::content_etags,
+			R"'''(
+			Use XXH64 hashes of static file contents as ETags, default: ``False``
+
+			A hash is computed once per file version (modification time and size).
+			Unlike default ETags based on modification time, content ETags do not change
+			after re-deploying the same files and are the same on all nodes.
+			)'''")
+		.def_readwrite("static_cache_size", &HttpServer<socket_ptr>::static_cache_size,
+			R"'''(
+			Get or set the max. total size of cached and gzip-compressed static files in bytes, default: 256MB
+
+			Hot static files that can not be sent with ``sendfile()``, e.g. over HTTPS,
+			are read into memory once and shared by all connections. Compressed files are cached as well.
+			``0`` disables the cache. Cached files must be replaced atomically (e.g. by renaming)
+			instead of being truncated and rewritten in place.
+			)'''")
+		.def_readwrite("static_cache_max_file_size", &HttpServer<socket_ptr>::static_cache_max_file_size,
+			"Get or set the max. size of a cached static file in bytes, default: 16MB")
+		.def_property_readonly("static_cache_used", &HttpServer<socket_ptr>::static_cache_used,
+			"Get the total size of cached static files and compressed files in bytes")
+		.def_readwrite("file_io_threads", &HttpServer<socket_ptr>::file_io_threads,
+			R"'''(
+			Get or set the number of threads for blocking static file reads and gzip compression, default: ``4``
+
+			Server threads do not wait for disk I/O while these threads are busy.
+			``0`` means that files are read on server threads.
+			)'''")
+		.def_readwrite("static_lookup_ttl", &HttpServer<socket_ptr>::static_lookup_ttl,
+			R"'''(
+			Get or set how long metadata of found static files are used without checking
+			the files for changes in milliseconds, default: ``0``
+
+			Paths of found files are resolved once, and repeated requests only check
+			the size and modification time of a file. Within this time a changed file
+			may be served with its previous size and modification time.
+			)'''")
+		.def_readwrite("static_not_found_ttl", &HttpServer<socket_ptr>::static_not_found_ttl,
+			R"'''(
+			Get or set how long missed static file paths are cached in milliseconds, default: ``1000``
+
+			Repeated requests for a nonexistent file get 404 without filesystem lookups,
+			so a file created after a miss is served after this time. ``0`` disables the cache.
+			)'''")
 		.def_readwrite("host_hame", &HttpServer<socket_ptr>::host_name, "Get or set the host name, default: automatically determined")
 		.def_readwrite("header_timeout", &HttpServer<socket_ptr>::header_timeout,
 			R"'''(
@@ -87,6 +134,40 @@ PYBIND11_PLUGIN(wsgi_boost)
 			or sending response before closing connection.
 			Default: 300s
 			)'''")
+		.def_readwrite("keepalive_timeout", &HttpServer<socket_ptr>::keepalive_timeout,
+			R"'''(
+			Get or set timeout for waiting for the next request on a keep-alive connection
+
+			This is the max. idle interval between requests before closing connection.
+			Default: 15s
+			)'''")
+		.def_readwrite("max_keepalive_requests", &HttpServer<socket_ptr>::max_keepalive_requests,
+			R"'''(
+			Get or set the max. number of requests served through one keep-alive connection
+
+			Default: 0 (unlimited)
+			)'''")
+		.def_readwrite("max_header_size", &HttpServer<socket_ptr>::max_header_size,
+			R"'''(
+			Get or set the max. size of a request header in bytes, default: 64KB
+
+			A client that sends a larger header gets "431 Request Header Fields Too Large"
+			as soon as the limit is crossed. ``0`` means no limit.
+			)'''")
+		.def_readwrite("max_header_count", &HttpServer<socket_ptr>::max_header_count,
+			R"'''(
+			Get or set the max. number of request header fields, default: ``100``
+
+			A request with more header fields is rejected with "431 Request Header Fields Too Large".
+			``0`` means no limit.
+			)'''")
+		.def_readwrite("max_body_size", &HttpServer<socket_ptr>::max_body_size,
+			R"'''(
+			Get or set the max. Content-Length of a request in bytes, default: ``0`` (unlimited)
+
+			A request with larger content is rejected with "413 Payload Too Large"
+			before its content is read, and the connection is closed.
+			)'''")
 		.def_readwrite("url_scheme", &HttpServer<socket_ptr>::url_scheme,
 			"Get or set URL scheme -- http or https (default: ``'http'``)"
 		)
@@ -95,6 +176,80 @@ PYBIND11_PLUGIN(wsgi_boost)
 			The value of ``Cache-Control`` HTTP header for static content
 			(default: ``'public, max-age=3600'``)
 			)'''")
+		.def_readwrite("max_connections", &HttpServer<socket_ptr>::max_connections,
+			R"'''(
+			Get or set the max. number of open connections
+
+			Excess connections receive ``503 Service Unavailable`` response
+			and are closed immediately.
+			Default: 0 (unlimited)
+			)'''")
+		.def_readwrite("max_wsgi_requests", &HttpServer<socket_ptr>::max_wsgi_requests,
+			R"'''(
+			Get or set the max. number of WSGI requests processed at the same time
+
+			Excess requests receive ``503 Service Unavailable`` response
+			without calling the WSGI application.
+			Default: 0 (unlimited)
+			)'''")
+		.def_readwrite("retry_after", &HttpServer<socket_ptr>::retry_after,
+			"Get or set ``Retry-After`` header value in seconds for ``503`` responses, default: 1")
+		.def_property_readonly("connections", &HttpServer<socket_ptr>::connections, "Get the number of open connections")
+		.def_property_readonly("wsgi_requests", &HttpServer<socket_ptr>::wsgi_requests,
+			"Get the number of WSGI requests being processed")
+		.def_property_readonly("shed_connections", &HttpServer<socket_ptr>::shed_connections,
+			"Get the number of connections rejected because of :attr:`max_connections` limit")
+		.def_property_readonly("shed_requests", &HttpServer<socket_ptr>::shed_requests,
+			"Get the number of requests rejected because of :attr:`max_wsgi_requests` limit")
+		.def_readwrite("access_log", &HttpServer<socket_ptr>::access_log,
+			R"'''(
+			Get or set access log file path, ``'-'`` for stdout
+
+			Log lines are written by a background thread.
+			Send ``SIGHUP`` signal to the process to re-open the file after log rotation.
+			Applied on server start. Default: ``''`` (no access log)
+			)'''")
+		.def_readwrite("access_log_format", &HttpServer<socket_ptr>::access_log_format,
+			R"'''(
+			Get or set access log line format
+
+			Supported directives: ``%h`` remote address, ``%t`` time, ``%r`` request line,
+			``%m`` method, ``%U`` path, ``%q`` query string, ``%H`` protocol, ``%s`` status code,
+			``%b`` response body bytes or ``-`` for none, ``%O`` bytes sent including headers,
+			``%D`` request time in microseconds, ``%{Name}i`` request header, ``%%`` percent sign.
+			Default: ``'%h - - %t "%r" %s %b "%{Referer}i" "%{User-Agent}i"'``
+			)'''")
+		.def_property_readonly("access_log_dropped", &HttpServer<socket_ptr>::access_log_dropped,
+			"Get the number of access log lines dropped because of full buffers")
+		.def_property("tracing", &HttpServer<socket_ptr>::tracing, &HttpServer<socket_ptr>::set_tracing,
+			R"'''(
+			Enable or disable request tracing
+
+			Traced requests record monotonic timestamps (ns) of their processing phases
+			in a fixed-size ring buffer that keeps the latest :attr:`trace_buffer_size` requests.
+			Default: ``False``
+			)'''")
+		.def_readwrite("trace_buffer_size", &HttpServer<socket_ptr>::trace_buffer_size,
+			"Get or set the number of request traces kept, applied on server start, default: 4096")
+		.def("get_traces", &HttpServer<socket_ptr>::get_traces,
+			R"'''(
+			Get recorded request traces
+
+			:return: a list of dicts with ``id``, ``thread``, ``method``, ``path`` keys
+			    and ``start``, ``header_read``, ``gil_wait``, ``app_start``, ``app_returned``,
+			    ``first_byte``, ``end`` timestamps in nanoseconds
+			    comparable with :func:`time.monotonic_ns` (``None`` if a phase was not reached).
+			:rtype: list
+			)'''")
+		.def("dump_traces", &HttpServer<socket_ptr>::dump_traces,
+			R"'''(
+			Write recorded request traces to a file in Chrome trace format
+
+			The file can be opened in ``chrome://tracing`` or Perfetto UI.
+
+			:param filename: output file name.
+			:type filename: str
+			)'''", py::arg("filename"))
 		.def("start", &HttpServer<socket_ptr>::start,
 			R"'''(
 			Start processing HTTP requests
@@ -104,7 +259,7 @@ PYBIND11_PLUGIN(wsgi_boost)
 			)'''")
 		.def("stop", &HttpServer<socket_ptr>::stop, "Stop processing HTTP requests")
 		.def("add_static_route", &HttpServer<socket_ptr>::add_static_route,
-				py::arg("path"), py::arg("content_dir"),
+				py::arg("path"), py::arg("content_dir"), py::arg("preload") = false,
 			R"'''(
 			Add a route for serving static files
 
@@ -114,19 +269,62 @@ PYBIND11_PLUGIN(wsgi_boost)
 			:type path: str
 			:param content_dir: a directory with static files to be served
 			:type content_dir: str
+			:param preload: look up files in ``content_dir`` and fill the static file cache
+				when the server starts, so the first requests do not wait for disk I/O
+				and gzip compression. File contents are not cached if they are sent with ``sendfile()``,
+				only compressed variants and content ETags are.
+			:type preload: bool
 
 			.. note:: ``path`` parameter is a regex that must start with ``^/``, for example :regexp:`^/static``
 				Static URL paths have priority over WSGI application paths,
 			    that is, if you set a static route for path :regexp:`^/` *all* requests for ``http://example.com/
 			    will be directed to that route and a WSGI application will never be reached.
 			)'''")
+		.def("set_error_page", &HttpServer<socket_ptr>::set_error_page,
+				py::arg("status_code"), py::arg("content"), py::arg("content_type") = "text/html",
+			R"'''(
+			Set a custom body for an error response
+
+			Error responses are rendered once when the server starts,
+			so this method must be called before :meth:`WsgiBoostHttp.start`.
+
+			:param status_code: HTTP status code: 400, 404, 405, 411, 413, 416, 431, 500 or 503
+			:type status_code: int
+			:param content: response body
+			:type content: str
+			:param content_type: body MIME type
+			:type content_type: str
+			:raises ValueError: if the status code is not supported
+			)'''")
 		.def("set_app", &HttpServer<socket_ptr>::set_app, py::arg("app"),
+				py::arg("path") = string(), py::arg("host") = string(),
 			R"'''(
 			Set a WSGI application to be served
 
+			Several applications can be served by the same server: an application
+			with ``path`` and/or ``host`` set is mounted at that URL path prefix
+			and/or ``Host`` header value. For mounted applications ``SCRIPT_NAME``
+			contains the path prefix and ``PATH_INFO`` contains the rest of the path.
+			Requests that match no mounted application go to the default application.
+			Routing is done in C++ without calling Python code.
+
 			:param app: a WSGI application to be served as an executable object
 			:type app: object
+			:param path: URL path prefix to mount the application at, e.g. ``'/api'``
+				(default: ``''`` -- any path)
+			:type path: str
+			:param host: ``Host`` header value (without port) to serve the application for
+				(default: ``''`` -- any host)
+			:type host: str
 			:raises RuntimeError: on attempt to set a WSGI application while the server is running
+
+			Usage:
+
+			.. code-block:: python
+
+				httpd.set_app(main_app)
+				httpd.set_app(api_app, path='/api')
+				httpd.set_app(admin_app, host='admin.example.com')
 			)'''")
 		;
 
@@ -145,7 +343,8 @@ PYBIND11_PLUGIN(wsgi_boost)
 		:type cert_chain: str
 		:param private_key: path to private key file
 		:type private_key: str
-		:param dh: path to Diffie-Hellman parameters file (optional)
+		:param dh: path to Diffie-Hellman parameters file (optional).
+			Not needed with the default ECDHE ciphers.
 		:type dt: str
 		:param address: server's address.
 		:type address: str
@@ -181,20 +380,94 @@ PYBIND11_PLUGIN(wsgi_boost)
 			py::arg("address") = string(), py::arg("port") = 4443, py::arg("threads") = 0)
 		.def_property_readonly("is_running", &HttpsServer<ssl_socket_ptr>::is_running)
 		.def_readwrite("use_gzip", &HttpsServer<ssl_socket_ptr>::use_gzip)
+		.def_readwrite("use_sendfile", &HttpsServer<ssl_socket_ptr>::use_sendfile)
+		.def_readwrite("content_etags", &HttpsServer<ssl_socket_ptr>::content_etags)
+		.def_readwrite("static_cache_size", &HttpsServer<ssl_socket_ptr>::static_cache_size)
+		.def_readwrite("static_cache_max_file_size", &HttpsServer<ssl_socket_ptr>::static_cache_max_file_size)
+		.def_property_readonly("static_cache_used", &HttpsServer<ssl_socket_ptr>::static_cache_used)
+		.def_readwrite("file_io_threads", &HttpsServer<ssl_socket_ptr>::file_io_threads)
+		.def_readwrite("static_lookup_ttl", &HttpsServer<ssl_socket_ptr>::static_lookup_ttl)
+		.def_readwrite("static_not_found_ttl", &HttpsServer<ssl_socket_ptr>::static_not_found_ttl)
 		.def_readwrite("host_hame", &HttpsServer<ssl_socket_ptr>::host_name)
 		.def_readwrite("header_timeout", &HttpsServer<ssl_socket_ptr>::header_timeout)
 		.def_readwrite("content_timeout", &HttpsServer<ssl_socket_ptr>::content_timeout)
+		.def_readwrite("keepalive_timeout", &HttpsServer<ssl_socket_ptr>::keepalive_timeout)
+		.def_readwrite("max_keepalive_requests", &HttpsServer<ssl_socket_ptr>::max_keepalive_requests)
+		.def_readwrite("max_header_size", &HttpsServer<ssl_socket_ptr>::max_header_size)
+		.def_readwrite("max_header_count", &HttpsServer<ssl_socket_ptr>::max_header_count)
+		.def_readwrite("max_body_size", &HttpsServer<ssl_socket_ptr>::max_body_size)
 		.def_readwrite("url_scheme", &HttpsServer<ssl_socket_ptr>::url_scheme, "Default: ``'https'``")
 		.def_readwrite("static_cache_control", &HttpsServer<ssl_socket_ptr>::static_cache_control)
 		.def_readwrite("redirect_http", &HttpsServer<ssl_socket_ptr>::redirect_http,
 			"Enable redirecting HTTP requests to HTTPS port (default:: ``False``)")
 		.def_readwrite("redirect_http_port", &HttpsServer<ssl_socket_ptr>::redirect_http_port,
 			"HTTP port to redirect requests from (default: ``80``)")
+		.def_readwrite("max_handshakes", &HttpsServer<ssl_socket_ptr>::max_handshakes,
+			R"'''(
+			Max. number of concurrent TLS handshakes per server thread
+
+			Excess handshakes are queued so that a burst of new connections
+			does not starve requests of established connections.
+			Default: 0 (unlimited)
+			)'''")
+		.def_readwrite("ciphers", &HttpsServer<ssl_socket_ptr>::ciphers,
+			R"'''(
+			Cipher list for TLS 1.2 and below in OpenSSL format
+
+			Default: ECDHE ciphers with AES-GCM and ChaCha20-Poly1305, ECDSA first.
+			Server cipher order is preferred.
+			)'''")
+		.def_readwrite("curves", &HttpsServer<ssl_socket_ptr>::curves,
+			"Elliptic curves for ECDHE key exchange (default: ``'X25519:P-256:P-384'``)")
+		.def_readwrite("min_tls_version", &HttpsServer<ssl_socket_ptr>::min_tls_version,
+			R"'''(
+			Min. TLS protocol version: ``'TLSv1'``, ``'TLSv1.1'``, ``'TLSv1.2'`` or ``'TLSv1.3'``
+			(default: ``'TLSv1.2'``)
+			)'''")
+		.def_readwrite("session_cache_size", &HttpsServer<ssl_socket_ptr>::session_cache_size,
+			"Max. number of TLS sessions in the server-side session cache, 0 disables the cache (default: ``20480``)")
+		.def_readwrite("session_timeout", &HttpsServer<ssl_socket_ptr>::session_timeout,
+			"TLS session lifetime in seconds (default: ``300``)")
+		.def_readwrite("session_tickets", &HttpsServer<ssl_socket_ptr>::session_tickets,
+			"Enable TLS session tickets (default: ``True``)")
+		.def_readwrite("ticket_key_lifetime", &HttpsServer<ssl_socket_ptr>::ticket_key_lifetime,
+			R"'''(
+			Rotation interval for session ticket keys in seconds (default: ``3600``)
+
+			Ticket keys are generated randomly and held in memory.
+			Tickets encrypted with the previous key are still accepted.
+			)'''")
+		.def("session_stats", &HttpsServer<ssl_socket_ptr>::session_stats,
+			R"'''(
+			Get TLS session resumption statistics
+
+			:return: a dict with OpenSSL session cache counters
+				(``accepts``, ``hits``, ``misses``, ``timeouts``, ``cache_full``, ``cached_sessions``)
+				and session ticket counters (``tickets_issued``, ``tickets_resumed``, ``tickets_unknown_key``)
+			:rtype: dict
+			)'''")
+		.def_readwrite("max_connections", &HttpsServer<ssl_socket_ptr>::max_connections)
+		.def_readwrite("max_wsgi_requests", &HttpsServer<ssl_socket_ptr>::max_wsgi_requests)
+		.def_readwrite("retry_after", &HttpsServer<ssl_socket_ptr>::retry_after)
+		.def_property_readonly("connections", &HttpsServer<ssl_socket_ptr>::connections)
+		.def_property_readonly("wsgi_requests", &HttpsServer<ssl_socket_ptr>::wsgi_requests)
+		.def_property_readonly("shed_connections", &HttpsServer<ssl_socket_ptr>::shed_connections)
+		.def_property_readonly("shed_requests", &HttpsServer<ssl_socket_ptr>::shed_requests)
+		.def_readwrite("access_log", &HttpsServer<ssl_socket_ptr>::access_log)
+		.def_readwrite("access_log_format", &HttpsServer<ssl_socket_ptr>::access_log_format)
+		.def_property_readonly("access_log_dropped", &HttpsServer<ssl_socket_ptr>::access_log_dropped)
+		.def_property("tracing", &HttpsServer<ssl_socket_ptr>::tracing, &HttpsServer<ssl_socket_ptr>::set_tracing)
+		.def_readwrite("trace_buffer_size", &HttpsServer<ssl_socket_ptr>::trace_buffer_size)
+		.def("get_traces", &HttpsServer<ssl_socket_ptr>::get_traces)
+		.def("dump_traces", &HttpsServer<ssl_socket_ptr>::dump_traces, py::arg("filename"))
 		.def("start", &HttpsServer<ssl_socket_ptr>::start)
 		.def("stop", &HttpsServer<ssl_socket_ptr>::stop)
 		.def("add_static_route", &HttpsServer<ssl_socket_ptr>::add_static_route,
-			py::arg("path"), py::arg("content_dir"))
-		.def("set_app", &HttpsServer<ssl_socket_ptr>::set_app, py::arg("app"))
+			py::arg("path"), py::arg("content_dir"), py::arg("preload") = false)
+		.def("set_error_page", &HttpsServer<ssl_socket_ptr>::set_error_page,
+			py::arg("status_code"), py::arg("content"), py::arg("content_type") = "text/html")
+		.def("set_app", &HttpsServer<ssl_socket_ptr>::set_app, py::arg("app"),
+			py::arg("path") = string(), py::arg("host") = string())
 		;
 
 	all.append("WsgiBoostHttps");